@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "filterimage.h"
+
+/*
+ * Times the separable FIR passes with uint8 and uint16 intermediate rows,
+ * for both arithmetics and both the two-pass and the fused backend, and
+ * reports the memory traffic and the error against a double precision
+ * reference that rounds only once.
+ *
+ * Usage: bench.out [width height channel_count kernel_radius repetitions threads]
+ */
+
+static double now_ms(void)
+{
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    return time.tv_sec * 1000.0 + time.tv_usec / 1000.0;
+}
+
+/* Smooth gradients with some noise, so the rounding of the intermediate rows shows in the output.*/
+static void fill_image(unsigned char *image, int w, int h, int channel_count)
+{
+    srand(1);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            for (int c = 0; c < channel_count; c++)
+            {
+                double value = 127.5 + 100 * sin((x + 40 * c) / 97.0) * cos(y / 73.0) + rand() % 17 - 8;
+                image[(y * w + x) * channel_count + c] = value < 0 ? 0 : (value > 255 ? 255 : value);
+            }
+        }
+    }
+}
+
+/* Both passes in double precision with REPEAT borders, unrounded.*/
+static double *reference_filter(const unsigned char *image, int w, int h, int channel_count, const float *kernel, int kernel_radius)
+{
+    int width = w * channel_count;
+    double *horizontal = malloc((size_t)width * h * sizeof(double));
+    double *filtered = malloc((size_t)width * h * sizeof(double));
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            double sum = 0;
+            for (int k = -kernel_radius; k <= kernel_radius; k++)
+            {
+                int column = x / channel_count + k;
+                column = column < 0 ? 0 : (column >= w ? w - 1 : column);
+                sum += image[y * width + column * channel_count + x % channel_count] * (double)kernel[k + kernel_radius];
+            }
+
+            horizontal[y * width + x] = sum;
+        }
+    }
+
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            double sum = 0;
+            for (int k = -kernel_radius; k <= kernel_radius; k++)
+            {
+                int row = y + k;
+                row = row < 0 ? 0 : (row >= h ? h - 1 : row);
+                sum += horizontal[row * width + x] * kernel[k + kernel_radius];
+            }
+
+            filtered[y * width + x] = sum;
+        }
+    }
+
+    free(horizontal);
+    return filtered;
+}
+
+int main(int argc, const char *argv[])
+{
+    int w = argc > 1 ? strtol(argv[1], NULL, 10) : 3840;
+    int h = argc > 2 ? strtol(argv[2], NULL, 10) : 2160;
+    int channel_count = argc > 3 ? strtol(argv[3], NULL, 10) : 4;
+    int kernel_radius = argc > 4 ? strtol(argv[4], NULL, 10) : 8;
+    int repetitions = argc > 5 ? strtol(argv[5], NULL, 10) : 10;
+    int threads = argc > 6 ? strtol(argv[6], NULL, 10) : 0;
+
+    size_t size = (size_t)w * h * channel_count;
+    unsigned char *image = malloc(size);
+    unsigned char *filtered = malloc(size);
+    unsigned char *horizontally_filtered = malloc(size * sizeof(unsigned short));
+    fill_image(image, w, h, channel_count);
+
+    float *kernel = malloc((2 * kernel_radius + 1) * sizeof(float));
+    short *fixed_kernel = malloc((2 * kernel_radius + 1) * sizeof(short));
+    create_1d_filter_kernel(&kernel, &gaussian_kernel_fun, kernel_radius);
+    if (!create_1d_fixed_kernel(&fixed_kernel, &kernel, kernel_radius))
+    {
+        printf("Kernel does not fit Q0.15\n");
+        return 1;
+    }
+
+    double *reference = reference_filter(image, w, h, channel_count, kernel, kernel_radius);
+
+    printf("Image: %ix%i, %i channels, kernel radius %i, best of %i\n", w, h, channel_count, kernel_radius, repetitions);
+    printf("%-9s %-6s %-6s %10s %12s %10s %10s %10s\n", "pass", "arith", "rows", "ms", "traffic MB", "GB/s", "mean err", "max err");
+    for (int fused = 0; fused < 2; fused++)
+    {
+        for (int arithmetic = 0; arithmetic < 2; arithmetic++)
+        {
+            for (int format = 0; format < 2; format++)
+            {
+                IntermediateFormat intermediate = format ? INTERMEDIATE_UINT16 : INTERMEDIATE_UINT8;
+                const short *weights = arithmetic ? fixed_kernel : NULL;
+                double best = INFINITY;
+                for (int i = 0; i < repetitions; i++)
+                {
+                    double start = now_ms();
+                    if (fused)
+                    {
+                        memcpy(filtered, image, size);
+                        start = now_ms();
+                        filter_image_separable_fused(&filtered, &filtered, w, h, &kernel, weights, intermediate, kernel_radius, channel_count, REPEAT, threads);
+                    }
+                    else
+                    {
+                        filter_image_separable(&filtered, &horizontally_filtered, &image, w, h, &kernel, weights, intermediate, kernel_radius, channel_count, REPEAT, threads);
+                    }
+
+                    double elapsed = now_ms() - start;
+                    best = elapsed < best ? elapsed : best;
+                }
+
+                // The image is read and written once. The two-pass backend also writes and reads every
+                // intermediate row through memory, while the fused ring buffer stays in cache.
+                double traffic = 2.0 * size + (fused ? 0 : 2.0 * size * (format ? 2 : 1));
+                double absolute_error = 0, max_error = 0;
+                for (size_t i = 0; i < size; i++)
+                {
+                    double error = fabs(filtered[i] - reference[i]);
+                    absolute_error += error;
+                    max_error = error > max_error ? error : max_error;
+                }
+
+                printf("%-9s %-6s %-6s %10.3f %12.1f %10.2f %10.4f %10.4f\n", fused ? "fused" : "two-pass", arithmetic ? "Q0.15" : "float",
+                       format ? "uint16" : "uint8", best, traffic / 1e6, traffic / best / 1e6, absolute_error / size, max_error);
+            }
+        }
+    }
+
+    free(reference);
+    free(fixed_kernel);
+    free(kernel);
+    free(horizontally_filtered);
+    free(filtered);
+    free(image);
+    return 0;
+}
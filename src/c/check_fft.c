@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filterimage.h"
+
+/*
+ * Checks filter_image_fft against filter_image_direct_2d on small images,
+ * including sizes smaller than the kernel, for 1 to 4 channels, both
+ * overflow modes and kernels with negative weights. Both round to nearest,
+ * so they may differ by one level where the exact result lies close to .5.
+ *
+ * Usage: check_fft.out
+ */
+
+/* A disc, or random weights of either sign that sum to 1.*/
+static void fill_kernel(float *kernel, int kernel_radius, int signed_weights)
+{
+    int taps = 2 * kernel_radius + 1;
+    create_disc_kernel(kernel, kernel_radius);
+    if (!signed_weights)
+    {
+        return;
+    }
+
+    double sum = 0;
+    for (int i = 0; i < taps * taps; i++)
+    {
+        kernel[i] = (rand() % 201 - 100) / 100.0f;
+        sum += kernel[i];
+    }
+
+    // Like a sharpening kernel, the weights cancel out apart from the middle tap.
+    for (int i = 0; i < taps * taps; i++)
+    {
+        kernel[i] -= sum / (taps * taps);
+    }
+
+    kernel[kernel_radius * taps + kernel_radius] += 1;
+}
+
+int main(void)
+{
+    const int sizes[] = {1, 2, 3, 7, 17};
+    const int radii[] = {1, 2, 5};
+    const int size_count = sizeof(sizes) / sizeof(sizes[0]);
+    const int radius_count = sizeof(radii) / sizeof(radii[0]);
+    int cases = 0, failures = 0;
+    srand(1);
+    for (int i = 0; i < size_count * size_count; i++)
+    {
+        int w = sizes[i % size_count], h = sizes[i / size_count];
+        for (int channel_count = 1; channel_count <= 4; channel_count++)
+        {
+            for (int r = 0; r < radius_count; r++)
+            {
+                for (int mode = 0; mode < 4; mode++)
+                {
+                    OverflowMode overflow_mode = mode & 1 ? IGNORE : REPEAT;
+                    int kernel_radius = radii[r];
+                    int taps = 2 * kernel_radius + 1;
+                    float *kernel = malloc(taps * taps * sizeof(float));
+                    fill_kernel(kernel, kernel_radius, mode & 2);
+
+                    size_t size = (size_t)w * h * channel_count;
+                    unsigned char *direct = malloc(size);
+                    unsigned char *fft = malloc(size);
+                    for (size_t j = 0; j < size; j++)
+                    {
+                        direct[j] = fft[j] = rand();
+                    }
+
+                    filter_image_direct_2d(&direct, w, h, channel_count, kernel, kernel_radius, overflow_mode, 1);
+                    filter_image_fft(&fft, w, h, channel_count, kernel, kernel_radius, overflow_mode, 1);
+
+                    int max_error = 0;
+                    for (size_t j = 0; j < size; j++)
+                    {
+                        int error = abs(direct[j] - fft[j]);
+                        max_error = error > max_error ? error : max_error;
+                    }
+
+                    cases++;
+                    if (max_error > 1)
+                    {
+                        failures++;
+                        printf("FAIL %ix%i, %i channels, radius %i, %s, %s kernel: max error %i\n", w, h, channel_count, kernel_radius,
+                               overflow_mode == REPEAT ? "REPEAT" : "IGNORE", mode & 2 ? "signed" : "disc", max_error);
+                    }
+
+                    free(fft);
+                    free(direct);
+                    free(kernel);
+                }
+            }
+        }
+    }
+
+    printf("filter_image_fft against filter_image_direct_2d: %i of %i cases passed\n", cases - failures, cases);
+    return failures > 0;
+}
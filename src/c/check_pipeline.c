@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filterimage.h"
+
+/*
+ * Checks that pipeline stages give the same bytes as the separate calls:
+ * a blur stage as filter(), an unsharp stage as unsharp_mask and two blur
+ * stages as two filter() calls, over images smaller and larger than a
+ * pipeline tile, for 1 to 4 channels and both overflow modes.
+ *
+ * Usage: check_pipeline.out
+ */
+
+int main(void)
+{
+    const int sizes[][2] = {{1, 1}, {7, 3}, {40, 33}, {300, 200}};
+    const int radii[] = {1, 2, 5, 12};
+    const int size_count = sizeof(sizes) / sizeof(sizes[0]);
+    const int radius_count = sizeof(radii) / sizeof(radii[0]);
+    filter_options options = filter_default_options();
+    int cases = 0, failures = 0;
+    srand(1);
+    for (int i = 0; i < size_count; i++)
+    {
+        int w = sizes[i][0], h = sizes[i][1];
+        for (int channel_count = 1; channel_count <= 4; channel_count++)
+        {
+            for (int r = 0; r < radius_count; r++)
+            {
+                for (int test = 0; test < 6; test++)
+                {
+                    OverflowMode overflow_mode = test & 1 ? IGNORE : REPEAT;
+                    int stages = test / 2; // A blur, an unsharp mask, or two blurs.
+                    int kernel_radius = radii[r];
+                    size_t size = (size_t)w * h * channel_count;
+                    unsigned char *separate = malloc(size);
+                    unsigned char *pipelined = malloc(size);
+                    for (size_t j = 0; j < size; j++)
+                    {
+                        separate[j] = pipelined[j] = rand();
+                    }
+
+                    filter_pipeline pipeline;
+                    filter_pipeline_init(&pipeline);
+                    if (stages == 1)
+                    {
+                        filter_pipeline_add_unsharp(&pipeline, kernel_radius, 1.5f, 2);
+                        unsharp_mask(&separate, w, h, channel_count, kernel_radius, 1.5f, 2, overflow_mode, &options);
+                    }
+                    else
+                    {
+                        for (int stage = 0; stage < (stages == 0 ? 1 : 2); stage++)
+                        {
+                            filter_pipeline_add_blur(&pipeline, kernel_radius, &gaussian_kernel_fun);
+                            filter(&separate, w, h, channel_count, kernel_radius, &gaussian_kernel_fun, overflow_mode, &options);
+                        }
+                    }
+
+                    filter_pipeline_run(&pipeline, &pipelined, w, h, channel_count, overflow_mode, &options);
+
+                    int max_error = 0;
+                    for (size_t j = 0; j < size; j++)
+                    {
+                        int error = abs(separate[j] - pipelined[j]);
+                        max_error = error > max_error ? error : max_error;
+                    }
+
+                    cases++;
+                    if (max_error > 0)
+                    {
+                        failures++;
+                        printf("FAIL %ix%i, %i channels, radius %i, %s, %s: max error %i\n", w, h, channel_count, kernel_radius,
+                               overflow_mode == REPEAT ? "REPEAT" : "IGNORE", stages == 0 ? "blur" : (stages == 1 ? "unsharp" : "two blurs"), max_error);
+                    }
+
+                    free(pipelined);
+                    free(separate);
+                }
+            }
+        }
+    }
+
+    printf("Pipeline stages against separate calls: %i of %i cases passed\n", cases - failures, cases);
+    return failures > 0;
+}
@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 
 #include "cl_helper.h"
 
@@ -22,40 +25,336 @@ void cl_handle_err(cl_int err_nr, int i)
     }
 }
 
-void cl_init(cl_handle *handle, const char *source)
+#define CL_BUILD_OPTIONS "-I. -g"
+
+/* FNV-1a, continuing from `hash`.*/
+static unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t size)
 {
-    cl_platform_id platform_id = NULL;
-    cl_device_id device_id = NULL;
-    cl_uint ret_num_devices;
-    cl_uint ret_num_platforms;
-    cl_int ret = clGetPlatformIDs(1, &platform_id, &ret_num_platforms); // TODO: Multiple platforms/devices?
-    cl_handle_err(ret, 0);
-    ret = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_GPU, 1, &device_id, &ret_num_devices);
-    cl_handle_err(ret, 1);
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
 
-    handle->context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &ret);
-    cl_handle_err(ret, 2);
+    return hash;
+}
 
-    handle->command_queue = clCreateCommandQueue(handle->context, device_id, 0, &ret);
-    cl_handle_err(ret, 3);
+static unsigned long long hash_device_info(unsigned long long hash, cl_device_id device_id, cl_device_info param)
+{
+    char info[256] = {0};
+    clGetDeviceInfo(device_id, param, sizeof(info) - 1, info, NULL);
+    return hash_bytes(hash, info, strlen(info) + 1);
+}
+
+/*
+ * Built programs are cached in $CL_CACHE_DIR, or else $TMPDIR or /tmp, in a file named after a hash of the source,
+ * the build options and the device, its OpenCL version and driver version. A driver update or a change to the
+ * kernels then just misses the cache. Headers the source includes are not part of the key, so a change to
+ * filterimage_types.h alone needs the cache cleared.
+ */
+static void program_cache_path(char *path, size_t size, const char *source, cl_device_id device_id)
+{
+    unsigned long long key = hash_bytes(0xcbf29ce484222325ULL, source, strlen(source) + 1);
+    key = hash_bytes(key, CL_BUILD_OPTIONS, sizeof(CL_BUILD_OPTIONS));
+    key = hash_device_info(key, device_id, CL_DEVICE_NAME);
+    key = hash_device_info(key, device_id, CL_DEVICE_VERSION);
+    key = hash_device_info(key, device_id, CL_DRIVER_VERSION);
+
+    const char *directory = getenv("CL_CACHE_DIR");
+    directory = directory != NULL ? directory : getenv("TMPDIR");
+    directory = directory != NULL ? directory : "/tmp";
+    snprintf(path, size, "%s/filterimage-%016llx.clbin", directory, key);
+}
+
+/* The cached program built for device_id, or NULL when there is none or the driver rejects it.*/
+static cl_program load_cached_program(cl_handle *handle, cl_device_id device_id, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *binary = size > 0 ? malloc(size) : NULL;
+    size_t binary_size = binary != NULL ? fread(binary, 1, size, file) : 0;
+    fclose(file);
+    if (binary_size == 0 || binary_size != (size_t)size)
+    {
+        free(binary);
+        return NULL;
+    }
+
+    cl_int ret, binary_status;
+    const unsigned char *binaries[] = {binary};
+    cl_program program = clCreateProgramWithBinary(handle->context, 1, &device_id, &binary_size, binaries, &binary_status, &ret);
+    free(binary);
+    if (ret != CL_SUCCESS || binary_status != CL_SUCCESS)
+    {
+        if (ret == CL_SUCCESS)
+        {
+            clReleaseProgram(program);
+        }
+
+        return NULL;
+    }
 
+    if (clBuildProgram(program, 1, &device_id, CL_BUILD_OPTIONS, NULL, NULL) != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+/* Writes the binary of a program built for one device, through a temporary file so that a concurrent start
+   never reads half of it.*/
+static void save_program_binary(cl_program program, const char *path)
+{
+    size_t binary_size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL) != CL_SUCCESS || binary_size == 0)
+    {
+        return;
+    }
+
+    unsigned char *binary = malloc(binary_size);
+    unsigned char *binaries[] = {binary};
+    char temporary_path[1024 + sizeof(".tmp")];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+    FILE *file;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) == CL_SUCCESS && (file = fopen(temporary_path, "wb")) != NULL)
+    {
+        size_t written = fwrite(binary, 1, binary_size, file);
+        if (fclose(file) == 0 && written == binary_size)
+        {
+            rename(temporary_path, path);
+        }
+        else
+        {
+            remove(temporary_path);
+        }
+    }
+
+    free(binary);
+}
+
+static cl_program build_program(cl_handle *handle, cl_device_id device_id, const char *source)
+{
+    cl_int ret;
     size_t source_len = strlen(source);
-    handle->program = clCreateProgramWithSource(handle->context, 1, (const char **)&source, (const size_t *)&source_len, &ret);
+    cl_program program = clCreateProgramWithSource(handle->context, 1, (const char **)&source, (const size_t *)&source_len, &ret);
     cl_handle_err(ret, 4);
 
-    ret = clBuildProgram(handle->program, 1, &device_id, "-I. -g", NULL, NULL);
+    cl_int build_ret = clBuildProgram(program, 1, &device_id, CL_BUILD_OPTIONS, NULL, NULL);
     size_t len = 0;
-    ret = clGetProgramBuildInfo(handle->program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+    ret = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
     char *buffer = calloc(len, sizeof(char));
-    ret = clGetProgramBuildInfo(handle->program, device_id, CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
+    ret = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
     if (len > 1)
         printf("OpenCL build info:\n%s\n", buffer);
+    free(buffer);
     cl_handle_err(ret, 5);
+    cl_handle_err(build_ret, 5);
+    return program;
+}
+
+#define CL_MAX_DEVICES 32
+
+/* Devices of all platforms, in platform order. Returns how many there are.*/
+static int enumerate_devices(cl_device_id *devices)
+{
+    cl_platform_id platforms[CL_MAX_DEVICES];
+    cl_uint platform_count = 0;
+    if (clGetPlatformIDs(CL_MAX_DEVICES, platforms, &platform_count) != CL_SUCCESS)
+    {
+        return 0;
+    }
+
+    int count = 0;
+    for (cl_uint i = 0; i < platform_count && i < CL_MAX_DEVICES && count < CL_MAX_DEVICES; i++)
+    {
+        // Platforms without devices return CL_DEVICE_NOT_FOUND, which just adds none.
+        cl_uint device_count = 0;
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, CL_MAX_DEVICES - count, devices + count, &device_count) == CL_SUCCESS)
+        {
+            count += device_count < (cl_uint)(CL_MAX_DEVICES - count) ? device_count : CL_MAX_DEVICES - count;
+        }
+    }
+
+    return count;
+}
+
+static cl_device_type device_type(cl_device_id device_id)
+{
+    cl_device_type type = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    return type;
+}
+
+static const char *device_type_name(cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU)
+    {
+        return "gpu";
+    }
+
+    if (type & CL_DEVICE_TYPE_ACCELERATOR)
+    {
+        return "accelerator";
+    }
+
+    return type & CL_DEVICE_TYPE_CPU ? "cpu" : "other";
+}
+
+/* Type rank first, then compute units times clock as a rough throughput.*/
+static double device_score(cl_device_id device_id)
+{
+    cl_device_type type = device_type(device_id);
+    cl_uint compute_units = 0, clock = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock), &clock, NULL);
+    double rank = type & CL_DEVICE_TYPE_GPU ? 3 : (type & CL_DEVICE_TYPE_ACCELERATOR ? 2 : (type & CL_DEVICE_TYPE_CPU ? 1 : 0));
+    return rank * 1e12 + (double)compute_units * clock;
+}
+
+void cl_list_devices(void)
+{
+    cl_device_id devices[CL_MAX_DEVICES];
+    int count = enumerate_devices(devices);
+    for (int i = 0; i < count; i++)
+    {
+        char name[256] = {0};
+        clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+        printf("\t%i: %s (%s)\n", i, name, device_type_name(device_type(devices[i])));
+    }
+}
+
+/* The device device_selector picks, as described at cl_init. Exits when there is none.*/
+static cl_device_id select_device(const char *device_selector)
+{
+    cl_device_id devices[CL_MAX_DEVICES];
+    int count = enumerate_devices(devices);
+    if (count == 0)
+    {
+        printf("No OpenCL devices found\n");
+        exit(-1);
+    }
+
+    cl_device_type wanted_type = 0;
+    int index = -1;
+    if (device_selector != NULL && *device_selector != '\0')
+    {
+        char *end;
+        long number = strtol(device_selector, &end, 10);
+        index = *end == '\0' ? number : -1;
+        wanted_type = strcmp(device_selector, "gpu") == 0 ? CL_DEVICE_TYPE_GPU : wanted_type;
+        wanted_type = strcmp(device_selector, "cpu") == 0 ? CL_DEVICE_TYPE_CPU : wanted_type;
+        wanted_type = strcmp(device_selector, "accelerator") == 0 ? CL_DEVICE_TYPE_ACCELERATOR : wanted_type;
+    }
+
+    if (index >= 0)
+    {
+        if (index >= count)
+        {
+            printf("No OpenCL device %i, there are %i:\n", index, count);
+            cl_list_devices();
+            exit(-1);
+        }
+
+        return devices[index];
+    }
+
+    cl_device_id best = NULL;
+    double best_score = -1;
+    for (int i = 0; i < count; i++)
+    {
+        char name[256] = {0};
+        clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+        int matches = 1;
+        if (wanted_type != 0)
+        {
+            matches = (device_type(devices[i]) & wanted_type) != 0;
+        }
+        else if (device_selector != NULL && *device_selector != '\0')
+        {
+            matches = strstr(name, device_selector) != NULL;
+        }
+
+        double score = device_score(devices[i]);
+        if (matches && score > best_score)
+        {
+            best = devices[i];
+            best_score = score;
+        }
+    }
+
+    if (best == NULL)
+    {
+        printf("No OpenCL device matches \"%s\" among:\n", device_selector);
+        cl_list_devices();
+        exit(-1);
+    }
+
+    return best;
+}
+
+void cl_init(cl_handle *handle, const char *source, const char *device_selector)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    cl_int ret;
+    cl_device_id device_id = select_device(device_selector != NULL ? device_selector : getenv("CL_DEVICE"));
+    char device_name[256] = {0};
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL);
+    printf("OpenCL device: %s (%s)\n", device_name, device_type_name(device_type(device_id)));
+    handle->device = device_id;
+
+    handle->kernel_count = 0;
+    memset(handle->buffers, 0, sizeof(handle->buffers));
+
+    handle->context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &ret);
+    cl_handle_err(ret, 2);
+
+    handle->command_queue = clCreateCommandQueue(handle->context, device_id, 0, &ret);
+    cl_handle_err(ret, 3);
+
+    // Building from source can take seconds on some drivers, so the binary is kept for the next start.
+    char cache_path[1024];
+    program_cache_path(cache_path, sizeof(cache_path), source, device_id);
+    handle->program = load_cached_program(handle, device_id, cache_path);
+    int cached = handle->program != NULL;
+    if (!cached)
+    {
+        handle->program = build_program(handle, device_id, source);
+        save_program_binary(handle->program, cache_path);
+    }
+
+    gettimeofday(&end, NULL);
+    double init_time_used = (end.tv_sec - start.tv_sec) * 1000.0; // sec to ms
+    init_time_used += (end.tv_usec - start.tv_usec) / 1000.0;     // us to ms
+    printf("cl_init_time_used: %f (%s)\n", init_time_used, cached ? "cached program binary" : "built from source");
 }
 
 void cl_terminate(cl_handle *handle)
 {
     cl_int ret;
+    for (int i = 0; i < handle->kernel_count; i++)
+    {
+        ret = clReleaseKernel(handle->kernels[i].kernel);
+    }
+
+    for (int i = 0; i < CL_BUFFER_POOL_SIZE; i++)
+    {
+        if (handle->buffers[i].buffer != NULL)
+        {
+            ret = clReleaseMemObject(handle->buffers[i].buffer);
+        }
+    }
+
     ret = clReleaseProgram(handle->program);
     ret = clFlush(handle->command_queue);
     ret = clFinish(handle->command_queue);
@@ -77,13 +376,174 @@ cl_mem cl_alloc(size_t size, cl_handle *handle, void *data)
     return buffer;
 }
 
-void cl_execute_kernel(cl_handle *handle, cl_kernel *kernel, char *name, int num_args, void **args, int *args_sizes, int num_threads)
+cl_kernel cl_get_kernel(cl_handle *handle, const char *name)
+{
+    for (int i = 0; i < handle->kernel_count; i++)
+    {
+        if (strcmp(handle->kernels[i].name, name) == 0)
+        {
+            return handle->kernels[i].kernel;
+        }
+    }
+
+    if (handle->kernel_count == CL_KERNEL_CACHE_SIZE || strlen(name) >= sizeof(handle->kernels[0].name))
+    {
+        printf("CL kernel cache cannot hold %s\n", name);
+        exit(-1);
+    }
+
+    cl_int ret;
+    cl_cached_kernel *cached = &handle->kernels[handle->kernel_count++];
+    strcpy(cached->name, name);
+    cached->kernel = clCreateKernel(handle->program, name, &ret);
+    cl_handle_err(ret, 6);
+    return cached->kernel;
+}
+
+/* Rounds up to one of four sizes per power of two, so at most a quarter of a buffer goes unused.*/
+static size_t buffer_bucket_size(size_t size)
+{
+    size_t bucket = 256;
+    while (bucket < size)
+    {
+        bucket *= 2;
+    }
+
+    size_t step = bucket / 8;
+    size_t half = bucket / 2;
+    return size <= half ? half : half + (size - half + step - 1) / step * step;
+}
+
+/* The free pooled object closest in size, replaced by the caller unless *reuse is set because it has the same size
+   and shape. Objects the previous call took for a slightly different size are replaced that way, so the pool only
+   grows while all are in use. Returns an empty slot when none is free, or NULL when the pool is full.*/
+static cl_pooled_buffer *pool_slot(cl_handle *handle, size_t size, size_t width, size_t height, int *reuse)
+{
+    cl_pooled_buffer *slot = NULL;
+    size_t closest = (size_t)-1;
+    for (int i = 0; i < CL_BUFFER_POOL_SIZE; i++)
+    {
+        cl_pooled_buffer *pooled = &handle->buffers[i];
+        size_t distance = pooled->size > size ? pooled->size - size : size - pooled->size;
+        if (pooled->buffer != NULL && !pooled->in_use && distance < closest)
+        {
+            slot = pooled;
+            closest = distance;
+        }
+    }
+
+    for (int i = 0; slot == NULL && i < CL_BUFFER_POOL_SIZE; i++)
+    {
+        slot = handle->buffers[i].buffer == NULL ? &handle->buffers[i] : NULL;
+    }
+
+    *reuse = slot != NULL && slot->buffer != NULL && slot->size == size && slot->width == width && slot->height == height;
+    if (slot != NULL && !*reuse && slot->buffer != NULL)
+    {
+        clReleaseMemObject(slot->buffer);
+        slot->buffer = NULL;
+    }
+
+    return slot;
+}
+
+cl_mem cl_buffer_acquire(cl_handle *handle, size_t size, void *data)
+{
+    size_t bucket = buffer_bucket_size(size);
+    int reuse;
+    cl_pooled_buffer *slot = pool_slot(handle, bucket, 0, 0, &reuse);
+    if (slot == NULL)
+    {
+        // Every pooled buffer is in use; cl_buffer_release frees buffers it does not find in the pool.
+        return cl_alloc(size, handle, data);
+    }
+
+    if (!reuse)
+    {
+        slot->buffer = cl_alloc(bucket, handle, NULL);
+        slot->size = bucket;
+        slot->width = slot->height = 0;
+    }
+
+    slot->in_use = 1;
+    if (data != NULL)
+    {
+        cl_int ret = clEnqueueWriteBuffer(handle->command_queue, slot->buffer, CL_TRUE, 0, size, data, 0, NULL, NULL);
+        cl_handle_err(ret, 8);
+    }
+
+    return slot->buffer;
+}
+
+static cl_mem create_image(cl_handle *handle, size_t width, size_t height, int channel_count)
+{
+    cl_image_format format = {channel_count == 4 ? CL_RGBA : (channel_count == 2 ? CL_RG : CL_R), CL_UNSIGNED_INT8};
+    cl_image_desc description = {0};
+    description.image_type = CL_MEM_OBJECT_IMAGE2D;
+    description.image_width = width;
+    description.image_height = height;
+
+    cl_int ret;
+    cl_mem image = clCreateImage(handle->context, CL_MEM_READ_WRITE, &format, &description, NULL, &ret);
+    cl_handle_err(ret, 12);
+    return image;
+}
+
+cl_mem cl_image_acquire(cl_handle *handle, size_t width, size_t height, int channel_count, void *data)
+{
+    int reuse;
+    size_t size = width * height * channel_count;
+    cl_pooled_buffer *slot = pool_slot(handle, size, width, height, &reuse);
+    cl_mem image;
+    if (slot == NULL)
+    {
+        image = create_image(handle, width, height, channel_count);
+    }
+    else
+    {
+        if (!reuse)
+        {
+            slot->buffer = create_image(handle, width, height, channel_count);
+            slot->size = size;
+            slot->width = width;
+            slot->height = height;
+        }
+
+        slot->in_use = 1;
+        image = slot->buffer;
+    }
+
+    if (data != NULL)
+    {
+        size_t origin[] = {0, 0, 0};
+        size_t region[] = {width, height, 1};
+        cl_int ret = clEnqueueWriteImage(handle->command_queue, image, CL_TRUE, origin, region, 0, 0, data, 0, NULL, NULL);
+        cl_handle_err(ret, 8);
+    }
+
+    return image;
+}
+
+void cl_buffer_release(cl_handle *handle, cl_mem buffer)
+{
+    for (int i = 0; i < CL_BUFFER_POOL_SIZE; i++)
+    {
+        if (handle->buffers[i].buffer == buffer)
+        {
+            handle->buffers[i].in_use = 0;
+            return;
+        }
+    }
+
+    clReleaseMemObject(buffer);
+}
+
+static void set_kernel_args(cl_handle *handle, cl_kernel *kernel, char *name, int num_args, void **args, int *args_sizes)
 {
     cl_int ret;
     if (name != NULL)
     {
-        *kernel = clCreateKernel(handle->program, name, &ret);
-        cl_handle_err(ret, 6);
+        *kernel = cl_get_kernel(handle, name);
     }
 
     for (int i = 0; i < num_args; i++)
@@ -91,11 +551,36 @@ void cl_execute_kernel(cl_handle *handle, cl_kernel *kernel, char *name, int num
         ret = clSetKernelArg(*kernel, i, args_sizes[i], args[i]);
         cl_handle_err(ret, 9);
     }
+}
 
-    size_t local_item_size = 256;
-    size_t global_item_size = round_to_closest_p2(num_threads, local_item_size);
+static void run_kernel(cl_handle *handle, cl_kernel kernel, cl_uint dimensions, const size_t *global_item_size, const size_t *local_item_size)
+{
     cl_event event;
-    ret = clEnqueueNDRangeKernel(handle->command_queue, *kernel, 1, NULL, &global_item_size, &local_item_size, 0, NULL, &event);
+    cl_int ret = clEnqueueNDRangeKernel(handle->command_queue, kernel, dimensions, NULL, global_item_size, local_item_size, 0, NULL, &event);
     cl_handle_err(ret, 10);
     clWaitForEvents(1, &event);
-}
\ No newline at end of file
+    clReleaseEvent(event);
+}
+
+void cl_execute_kernel(cl_handle *handle, cl_kernel *kernel, char *name, int num_args, void **args, int *args_sizes, int num_threads)
+{
+    set_kernel_args(handle, kernel, name, num_args, args, args_sizes);
+    size_t local_item_size = 256;
+    size_t global_item_size = round_to_closest_p2(num_threads, local_item_size);
+    run_kernel(handle, *kernel, 1, &global_item_size, &local_item_size);
+}
+
+void cl_execute_kernel_2d(cl_handle *handle, cl_kernel *kernel, char *name, int num_args, void **args, int *args_sizes, size_t width, size_t height, size_t local_w, size_t local_h)
+{
+    set_kernel_args(handle, kernel, name, num_args, args, args_sizes);
+    if (local_w == 0 || local_h == 0)
+    {
+        size_t global_item_size[] = {width, height};
+        run_kernel(handle, *kernel, 2, global_item_size, NULL);
+        return;
+    }
+
+    size_t local_item_size[] = {local_w, local_h};
+    size_t global_item_size[] = {(width + local_w - 1) / local_w * local_w, (height + local_h - 1) / local_h * local_h};
+    run_kernel(handle, *kernel, 2, global_item_size, local_item_size);
+}
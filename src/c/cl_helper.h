@@ -5,19 +5,69 @@
 #include <CL/cl.h>
 #endif
 
+#define CL_KERNEL_CACHE_SIZE 8
+#define CL_BUFFER_POOL_SIZE 16
+
+typedef struct cl_cached_kernel
+{
+    char name[64];
+    cl_kernel kernel;
+} cl_cached_kernel;
+
+typedef struct cl_pooled_buffer
+{
+    cl_mem buffer;  // NULL for a free slot.
+    size_t size;    // Bucket size the buffer was created with, or bytes of an image.
+    size_t width;   // Pixels of an image, 0 for a buffer.
+    size_t height;
+    int in_use;
+} cl_pooled_buffer;
+
+/* The device session kept between filter calls. Besides the context, queue and program it holds the kernel
+   objects created so far and a pool of device buffers, so refiltering after the first call creates neither.*/
 typedef struct cl_handle
 {
+    cl_device_id device;
     cl_context context;
     cl_command_queue command_queue;
     cl_program program;
+    cl_cached_kernel kernels[CL_KERNEL_CACHE_SIZE];
+    int kernel_count;
+    cl_pooled_buffer buffers[CL_BUFFER_POOL_SIZE];
 } cl_handle;
 
 void cl_handle_err(cl_int err_nr, int i);
 
-void cl_init(cl_handle *, const char *);
+/* Creates the session on a device of any platform. device_selector, or else $CL_DEVICE, is a device type ("gpu",
+   "cpu" or "accelerator"), an index into the list printed by cl_list_devices or part of a device name. Without one
+   the device of most compute throughput is taken, GPUs before accelerators before CPUs, so machines without a GPU
+   fall back to a CPU runtime such as PoCL.*/
+void cl_init(cl_handle *, const char *source, const char *device_selector);
+
+void cl_list_devices(void);
 
 void cl_terminate(cl_handle *);
 
 cl_mem cl_alloc(size_t size, cl_handle *handle, void *data);
 
+/* Kernel `name` of the program, created on first use and released by cl_terminate.*/
+cl_kernel cl_get_kernel(cl_handle *handle, const char *name);
+
+/* A buffer of at least `size` bytes from the pool, filled with `data` unless it is NULL. Sizes are rounded up to
+   buckets, so sizes that change a little between calls share a buffer. Give it back with cl_buffer_release.*/
+cl_mem cl_buffer_acquire(cl_handle *handle, size_t size, void *data);
+
+/* A 2D image of width by height pixels of 1, 2 or 4 unsigned 8-bit channels from the same pool, filled with `data`
+   unless it is NULL. Images are only reused at the same size. Give it back with cl_buffer_release.*/
+cl_mem cl_image_acquire(cl_handle *handle, size_t width, size_t height, int channel_count, void *data);
+
+void cl_buffer_release(cl_handle *handle, cl_mem buffer);
+
+/* Sets the arguments of *kernel and runs it to completion. With a name, *kernel is first set to the cached kernel
+   of that name.*/
 void cl_execute_kernel(cl_handle *handle, cl_kernel *kernel, char *name, int num_args, void **args, int *args_sizes, int num_threads);
+
+/* Same over a 2D NDRange of work-groups of local_w by local_h items, rounded up to cover width by height, or of
+   exactly width by height items in groups the runtime picks when local_w or local_h is 0. A NULL argument of
+   non-zero size is local memory of that many bytes.*/
+void cl_execute_kernel_2d(cl_handle *handle, cl_kernel *kernel, char *name, int num_args, void **args, int *args_sizes, size_t width, size_t height, size_t local_w, size_t local_h);
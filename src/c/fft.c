@@ -0,0 +1,300 @@
+#include <math.h>
+#include <string.h>
+#include "scratch_arena.h"
+#include "fft.h"
+
+typedef struct fft_complex
+{
+    float re;
+    float im;
+} fft_complex;
+
+static fft_complex complex_add(fft_complex a, fft_complex b)
+{
+    fft_complex result = {a.re + b.re, a.im + b.im};
+    return result;
+}
+
+static fft_complex complex_sub(fft_complex a, fft_complex b)
+{
+    fft_complex result = {a.re - b.re, a.im - b.im};
+    return result;
+}
+
+static fft_complex complex_mul(fft_complex a, fft_complex b)
+{
+    fft_complex result = {a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re};
+    return result;
+}
+
+/* a * (sign * -i): a quarter turn clockwise for the forward transform, counterclockwise for the inverse.*/
+static fft_complex complex_rotate(fft_complex a, float sign)
+{
+    fft_complex result = {sign * a.im, -sign * a.re};
+    return result;
+}
+
+static fft_complex complex_scale(fft_complex a, float scale)
+{
+    fft_complex result = {a.re * scale, a.im * scale};
+    return result;
+}
+
+int fft_good_size(int n)
+{
+    for (;; n++)
+    {
+        int m = n;
+        while (m % 2 == 0)
+        {
+            m /= 2;
+        }
+
+        while (m % 3 == 0)
+        {
+            m /= 3;
+        }
+
+        while (m % 5 == 0)
+        {
+            m /= 5;
+        }
+
+        if (m <= 1)
+        {
+            return n;
+        }
+    }
+}
+
+static void fill_twiddles(float *twiddles, int count, int n)
+{
+    for (int k = 0; k < count; k++)
+    {
+        twiddles[2 * k] = cos(2 * M_PI * k / n);
+        twiddles[2 * k + 1] = -sin(2 * M_PI * k / n);
+    }
+}
+
+void fft_plan_init(fft_plan *plan, int n, scratch_arena *arena)
+{
+    plan->n = n;
+    plan->factor_count = 0;
+    static const int radices[] = {4, 2, 3, 5};
+    for (int i = 0; i < 4; i++)
+    {
+        while (n % radices[i] == 0)
+        {
+            plan->factors[plan->factor_count++] = radices[i];
+            n /= radices[i];
+        }
+    }
+
+    float *twiddles = scratch_arena_alloc(arena, 2 * (size_t)plan->n * sizeof(float));
+    fill_twiddles(twiddles, plan->n, plan->n);
+    plan->twiddles = twiddles;
+}
+
+void fft_real_plan_init(fft_real_plan *plan, int n, scratch_arena *arena)
+{
+    plan->n = n;
+    fft_plan_init(&plan->half, n / 2, arena);
+    float *twiddles = scratch_arena_alloc(arena, 2 * (size_t)(n / 2 + 1) * sizeof(float));
+    fill_twiddles(twiddles, n / 2 + 1, n);
+    plan->twiddles = twiddles;
+}
+
+/* One pass of a Stockham autosort FFT: `stride` interleaved transforms of `length` points each become
+   stride * radix transforms of length / radix points. Point t of transform j is x[j + stride * t], and
+   y[j + stride * (radix * q + k)] takes the k-th output of the radix-point DFT of points q, q + m, ..., times
+   the twiddle w^(q k).*/
+static void fft_pass(const fft_plan *plan, int radix, int length, int stride, const fft_complex *x, fft_complex *y, float sign)
+{
+    const fft_complex *twiddles = (const fft_complex *)plan->twiddles;
+    int m = length / radix;
+    int twiddle_step = plan->n / length;
+    for (int q = 0; q < m; q++)
+    {
+        fft_complex w[5];
+        for (int k = 1; k < radix; k++)
+        {
+            w[k] = twiddles[q * k * twiddle_step];
+            w[k].im *= sign;
+        }
+
+        const fft_complex *in = x + stride * q;
+        fft_complex *out = y + stride * radix * q;
+        if (radix == 2)
+        {
+            for (int j = 0; j < stride; j++)
+            {
+                fft_complex a0 = in[j], a1 = in[j + stride * m];
+                out[j] = complex_add(a0, a1);
+                out[j + stride] = complex_mul(complex_sub(a0, a1), w[1]);
+            }
+        }
+        else if (radix == 4)
+        {
+            for (int j = 0; j < stride; j++)
+            {
+                fft_complex a0 = in[j], a1 = in[j + stride * m], a2 = in[j + 2 * stride * m], a3 = in[j + 3 * stride * m];
+                fft_complex t0 = complex_add(a0, a2), t1 = complex_sub(a0, a2);
+                fft_complex t2 = complex_add(a1, a3), t3 = complex_rotate(complex_sub(a1, a3), sign);
+                out[j] = complex_add(t0, t2);
+                out[j + stride] = complex_mul(complex_add(t1, t3), w[1]);
+                out[j + 2 * stride] = complex_mul(complex_sub(t0, t2), w[2]);
+                out[j + 3 * stride] = complex_mul(complex_sub(t1, t3), w[3]);
+            }
+        }
+        else if (radix == 3)
+        {
+            // The cube roots of unity are -1/2 -+ i sqrt(3)/2.
+            for (int j = 0; j < stride; j++)
+            {
+                fft_complex a0 = in[j], a1 = in[j + stride * m], a2 = in[j + 2 * stride * m];
+                fft_complex sum = complex_add(a1, a2);
+                fft_complex middle = complex_sub(a0, complex_scale(sum, 0.5f));
+                fft_complex side = complex_rotate(complex_scale(complex_sub(a1, a2), 0.86602540378f), sign);
+                out[j] = complex_add(a0, sum);
+                out[j + stride] = complex_mul(complex_add(middle, side), w[1]);
+                out[j + 2 * stride] = complex_mul(complex_sub(middle, side), w[2]);
+            }
+        }
+        else
+        {
+            // With c1, c2 = cos(2pi/5), cos(4pi/5) and s1, s2 the sines, outputs 1 and 4 share the real parts
+            // a0 + c1 (a1 + a4) + c2 (a2 + a3), and outputs 2 and 3 the same with c1 and c2 swapped.
+            const float c1 = 0.30901699437f, c2 = -0.80901699437f, s1 = 0.95105651630f, s2 = 0.58778525229f;
+            for (int j = 0; j < stride; j++)
+            {
+                fft_complex a0 = in[j], a1 = in[j + stride * m], a2 = in[j + 2 * stride * m], a3 = in[j + 3 * stride * m], a4 = in[j + 4 * stride * m];
+                fft_complex t1 = complex_add(a1, a4), t2 = complex_add(a2, a3), t3 = complex_sub(a1, a4), t4 = complex_sub(a2, a3);
+                fft_complex b1 = complex_add(a0, complex_add(complex_scale(t1, c1), complex_scale(t2, c2)));
+                fft_complex b2 = complex_add(a0, complex_add(complex_scale(t1, c2), complex_scale(t2, c1)));
+                fft_complex d1 = complex_rotate(complex_add(complex_scale(t3, s1), complex_scale(t4, s2)), sign);
+                fft_complex d2 = complex_rotate(complex_sub(complex_scale(t3, s2), complex_scale(t4, s1)), sign);
+                out[j] = complex_add(a0, complex_add(t1, t2));
+                out[j + stride] = complex_mul(complex_add(b1, d1), w[1]);
+                out[j + 2 * stride] = complex_mul(complex_add(b2, d2), w[2]);
+                out[j + 3 * stride] = complex_mul(complex_sub(b2, d2), w[3]);
+                out[j + 4 * stride] = complex_mul(complex_sub(b1, d1), w[4]);
+            }
+        }
+    }
+}
+
+/* Starting the passes at stride `count` runs count transforms side by side, as the Stockham passes never mix
+   points of different transforms.*/
+static void fft_run(const fft_plan *plan, float *data, float *work, int count, float sign)
+{
+    fft_complex *x = (fft_complex *)data, *y = (fft_complex *)work;
+    int length = plan->n, stride = count;
+    for (int i = 0; i < plan->factor_count; i++)
+    {
+        fft_pass(plan, plan->factors[i], length, stride, x, y, sign);
+        length /= plan->factors[i];
+        stride *= plan->factors[i];
+        fft_complex *swap = x;
+        x = y;
+        y = swap;
+    }
+
+    if ((float *)x != data)
+    {
+        memcpy(data, x, (size_t)plan->n * count * sizeof(fft_complex));
+    }
+}
+
+void fft_forward(const fft_plan *plan, float *data, float *work)
+{
+    fft_run(plan, data, work, 1, 1);
+}
+
+void fft_inverse(const fft_plan *plan, float *data, float *work)
+{
+    fft_run(plan, data, work, 1, -1);
+}
+
+void fft_forward_many(const fft_plan *plan, float *data, float *work, int count)
+{
+    fft_run(plan, data, work, count, 1);
+}
+
+void fft_inverse_many(const fft_plan *plan, float *data, float *work, int count)
+{
+    fft_run(plan, data, work, count, -1);
+}
+
+double fft_cost(int n)
+{
+    // Flops per point of a pass of each radix, counting the twiddle multiplication.
+    double cost = 0;
+    static const int radices[] = {4, 2, 3, 5};
+    static const double pass_costs[] = {8.5, 5, 10, 12};
+    for (int i = 0; i < 4; i++)
+    {
+        for (; n % radices[i] == 0; n /= radices[i])
+        {
+            cost += pass_costs[i];
+        }
+    }
+
+    return cost;
+}
+
+/* The even and odd samples are the real and imaginary parts of a complex signal z of n / 2 points, so with
+   h = n / 2, E[k] = (Z[k] + conj(Z[h - k])) / 2, O[k] = -i (Z[k] - conj(Z[h - k])) / 2 and
+   X[k] = E[k] + exp(-2 pi i k / n) O[k]. Bins k and h - k come from the same two points, so this runs in place.*/
+void fft_real_forward(const fft_real_plan *plan, float *data, float *work)
+{
+    const fft_complex *twiddles = (const fft_complex *)plan->twiddles;
+    fft_complex *bins = (fft_complex *)data;
+    int h = plan->n / 2;
+    fft_forward(&plan->half, data, work);
+
+    fft_complex z0 = bins[0];
+    bins[0].re = z0.re + z0.im;
+    bins[0].im = 0;
+    bins[h].re = z0.re - z0.im;
+    bins[h].im = 0;
+    for (int k = 1; k <= h / 2; k++)
+    {
+        fft_complex a = bins[k], b = bins[h - k];
+        fft_complex a_conj = {a.re, -a.im}, b_conj = {b.re, -b.im};
+        fft_complex even = complex_scale(complex_add(a, b_conj), 0.5f);
+        fft_complex odd = complex_rotate(complex_scale(complex_sub(a, b_conj), 0.5f), 1);
+        fft_complex mirrored_even = complex_scale(complex_add(b, a_conj), 0.5f);
+        fft_complex mirrored_odd = complex_rotate(complex_scale(complex_sub(b, a_conj), 0.5f), 1);
+        bins[k] = complex_add(even, complex_mul(odd, twiddles[k]));
+        bins[h - k] = complex_add(mirrored_even, complex_mul(mirrored_odd, twiddles[h - k]));
+    }
+}
+
+/* E[k] = (X[k] + conj(X[h - k])) / 2 and O[k] = exp(2 pi i k / n) (X[k] - conj(X[h - k])) / 2 give back
+   Z[k] = E[k] + i O[k], whose inverse holds the even and odd samples.*/
+void fft_real_inverse(const fft_real_plan *plan, float *data, float *work)
+{
+    const fft_complex *twiddles = (const fft_complex *)plan->twiddles;
+    fft_complex *bins = (fft_complex *)data;
+    int h = plan->n / 2;
+
+    fft_complex x0 = bins[0], xh = bins[h];
+    bins[0].re = 0.5f * (x0.re + xh.re);
+    bins[0].im = 0.5f * (x0.re - xh.re);
+    for (int k = 1; k <= h / 2; k++)
+    {
+        fft_complex a = bins[k], b = bins[h - k];
+        fft_complex a_conj = {a.re, -a.im}, b_conj = {b.re, -b.im};
+        fft_complex w = twiddles[k], mirrored_w = twiddles[h - k];
+        w.im = -w.im;
+        mirrored_w.im = -mirrored_w.im;
+        fft_complex even = complex_scale(complex_add(a, b_conj), 0.5f);
+        fft_complex odd = complex_mul(complex_scale(complex_sub(a, b_conj), 0.5f), w);
+        fft_complex mirrored_even = complex_scale(complex_add(b, a_conj), 0.5f);
+        fft_complex mirrored_odd = complex_mul(complex_scale(complex_sub(b, a_conj), 0.5f), mirrored_w);
+        bins[k] = complex_add(even, complex_rotate(odd, -1));
+        bins[h - k] = complex_add(mirrored_even, complex_rotate(mirrored_odd, -1));
+    }
+
+    fft_inverse(&plan->half, data, work);
+}
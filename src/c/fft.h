@@ -0,0 +1,48 @@
+struct scratch_arena;
+
+/* Complex FFT of n points, n having no prime factor above 5. Points are interleaved (re, im) floats. Plans only
+   point into their arena, so they are valid until it is rewound past them, and may be shared between threads.*/
+typedef struct fft_plan
+{
+    int n;
+    int factor_count;
+    int factors[32];
+    const float *twiddles; // exp(-2 pi i k / n) for k < n.
+} fft_plan;
+
+/* FFT of n real samples, n even, through a complex FFT of n / 2 points.*/
+typedef struct fft_real_plan
+{
+    int n;
+    fft_plan half;
+    const float *twiddles; // exp(-2 pi i k / n) for k <= n / 2.
+} fft_real_plan;
+
+/* Smallest size of at least n whose only prime factors are 2, 3 and 5.*/
+int fft_good_size(int n);
+
+void fft_plan_init(fft_plan *plan, int n, struct scratch_arena *arena);
+
+void fft_real_plan_init(fft_real_plan *plan, int n, struct scratch_arena *arena);
+
+/* Transforms n points in place. work holds n points. The inverse is not normalized, so a forward and an inverse
+   transform scale the data by n.*/
+void fft_forward(const fft_plan *plan, float *data, float *work);
+
+void fft_inverse(const fft_plan *plan, float *data, float *work);
+
+/* Transforms `count` sets of n points at once, point t of set j at data[2 * (t * count + j)], such as the columns
+   of count complex samples per row. work holds n * count points.*/
+void fft_forward_many(const fft_plan *plan, float *data, float *work, int count);
+
+void fft_inverse_many(const fft_plan *plan, float *data, float *work, int count);
+
+/* Work per point of a transform of n points, relative between sizes, for picking one.*/
+double fft_cost(int n);
+
+/* Transforms n real samples in data to the n / 2 + 1 bins of non-negative frequency in place, so data holds n + 2
+   floats. work holds n floats.*/
+void fft_real_forward(const fft_real_plan *plan, float *data, float *work);
+
+/* Inverse of fft_real_forward, scaled by n / 2.*/
+void fft_real_inverse(const fft_real_plan *plan, float *data, float *work);
@@ -1,318 +1,3343 @@
 #include <string.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <math.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "filterimage.h"
+#include "filterimage_simd.h"
+#include "threadpool.h"
+#include "fft.h"
 
-/* Convolves a horizontal filter kernel across an image region.*/
-unsigned char filter_region_one_channel_horizontal(unsigned char **image, int width, int start, int end, float **kernel, int kernel_radius, int channel_count)
+/* Converts an accumulated sample to a byte, saturating like the SIMD packs do.*/
+static unsigned char saturate_sample(float result)
 {
-    int midpoint = (start + end) / 2;
-    double start_row = floor((double)start / width);
-    double midpoint_row = floor((double)midpoint / width);
-    double end_row = floor((double)end / width);
+    if (result < 0)
+    {
+        return 0;
+    }
+
+    return result > 255 ? 255 : result;
+}
+
+/* Rounds a float result to SAMPLE_UINT16_8_7 like the SIMD packs do. The weights already carry the 2^7 scale.*/
+static unsigned short wide_sample(float result)
+{
+    long rounded = lrintf(result);
+    if (rounded < 0)
+    {
+        return 0;
+    }
+
+    return rounded > 32767 ? 32767 : rounded;
+}
+
+/* Shifts a Q0.15 accumulator right by `shift`, rounding to nearest, and saturates it to [0, max].*/
+static int fixed_sample(int result, int shift, int max)
+{
+    result = (result + (1 << (shift - 1))) >> shift;
+    if (result < 0)
+    {
+        return 0;
+    }
+
+    return result > max ? max : result;
+}
+
+/* Reads sample x of a row of `format` samples.*/
+static int load_sample(const unsigned char *row, int x, SampleFormat format)
+{
+    return format == SAMPLE_UINT8 ? row[x] : ((const unsigned short *)row)[x];
+}
+
+/* Per-band buffers of the fused pass.*/
+typedef struct fused_band
+{
+    unsigned char *ring;
+    unsigned char *top_halo;
+    unsigned char *bottom_halo;
+} fused_band;
+
+/* Unsharp masking applied by the separable passes as they write each blurred row, see unsharp_mask.*/
+typedef struct unsharp_params
+{
+    float amount;
+    int threshold;
+} unsharp_params;
+
+/* Shared state for the row-band tasks handed to the thread pool.*/
+typedef struct band_job
+{
+    unsigned char *filtered;
+    unsigned char *horizontally_filtered;
+    unsigned char *image;
+    int w;
+    int h;
+    float *kernel; // Horizontal weights.
+    int kernel_radius;
+    int channel_count;
+    OverflowMode overflow_mode;
+    SampleFormat intermediate; // Format of the horizontally filtered rows.
+    float *vertical_kernel;
+    row_filter_fun row_filter; // Horizontal, steps by channel_count.
+    row_filter_fun column_filter; // Vertical, steps by the row width.
+    rows_filter_fun rows_filter;
+    const short *fixed_kernel; // Q0.15 weights, NULL to filter with `kernel`.
+    fixed_row_filter_fun fixed_row_filter;
+    fixed_row_filter_fun fixed_column_filter;
+    fixed_rows_filter_fun fixed_rows_filter;
+    unsigned char *zero_row; // Window row of taps outside the image under IGNORE.
+    const unsigned char **windows; // 2r+1 row pointers per band.
+    fused_band *fused_bands;
+    unsigned int *column_sums; // One row of box filter sums per band.
+    const unsharp_params *unsharp; // NULL to write the blurred rows as they are.
+    unsigned char *blurred_rows; // One row per band, when unsharp masking.
+    float average_offset;
+    int first_row;
+    int row_count;
+    int band_count;
+} band_job;
+
+/* Splits [first_row, first_row + row_count) into band_count contiguous bands.*/
+static void band_rows(band_job *job, int band, int *start, int *end)
+{
+    *start = job->first_row + (int)((long)job->row_count * band / job->band_count);
+    *end = job->first_row + (int)((long)job->row_count * (band + 1) / job->band_count);
+}
+
+/* A few bands per thread keeps the workers balanced when some finish early.*/
+static int band_count_for(int threads, int rows)
+{
+    if (threads <= 0)
+    {
+        threads = thread_pool_available_threads();
+    }
+
+    int bands = threads > 1 ? threads * 4 : 1;
+    return bands < rows ? bands : (rows > 0 ? rows : 1);
+}
+
+/* Splits [0, length) into the border strips before `start` and from `end`, and the interior between them
+   where a window of `reach` on both sides stays in bounds.*/
+static void interior_range(int length, int reach, int *start, int *end)
+{
+    *start = reach < length ? reach : length;
+    *end = length - reach > *start ? length - reach : *start;
+}
+
+/* Bytes per horizontally filtered row.*/
+static size_t intermediate_row_size(band_job *job)
+{
+    return (size_t)job->w * job->channel_count * (job->intermediate == SAMPLE_UINT8 ? 1 : 2);
+}
+
+/* Whether a sum of SAMPLE_UINT16_8_7 samples times the Q0.15 weights, plus the rounding bias, fits 32 bits.
+   create_1d_fixed_kernel only checks this for 8-bit samples.*/
+static int fixed_kernel_fits_wide(const short *fixed_kernel, int taps)
+{
+    long magnitude = 0;
+    for (int i = 0; i < taps; i++)
+    {
+        magnitude += labs(fixed_kernel[i]);
+    }
+
+    return magnitude <= (INT_MAX - (1 << 21)) / 32767;
+}
+
+/* Sets up the intermediate format, the weights of both passes, the zero row, the windows of job->band_count bands
+   and the SIMD filters, specialized where one exists. The fixed-point ones are only picked when `fixed_kernel` is
+   not NULL. Fixed kernels too large for uint16 intermediate rows fall back to uint8 ones.*/
+static void band_job_prepare(band_job *job, scratch_arena *arena, const short *fixed_kernel, IntermediateFormat intermediate)
+{
+    int taps = 2 * job->kernel_radius + 1;
+    int width = job->w * job->channel_count;
+    job->intermediate = intermediate == INTERMEDIATE_UINT16 ? SAMPLE_UINT16_8_7 : SAMPLE_UINT8;
+    if (fixed_kernel != NULL && !fixed_kernel_fits_wide(fixed_kernel, taps))
+    {
+        job->intermediate = SAMPLE_UINT8;
+    }
+
+    // Scaling by 2^7 is exact, so the float paths give the same sums as with the unscaled weights.
+    job->vertical_kernel = job->kernel;
+    if (job->intermediate == SAMPLE_UINT16_8_7 && fixed_kernel == NULL)
+    {
+        float *scaled_kernels = scratch_arena_alloc(arena, 2 * taps * sizeof(float));
+        for (int k = 0; k < taps; k++)
+        {
+            scaled_kernels[k] = job->kernel[k] * 128;
+            scaled_kernels[taps + k] = job->kernel[k] / 128;
+        }
+
+        job->kernel = scaled_kernels;
+        job->vertical_kernel = scaled_kernels + taps;
+    }
+
+    job->zero_row = job->overflow_mode == IGNORE ? scratch_arena_calloc(arena, intermediate_row_size(job)) : NULL;
+    job->windows = scratch_arena_alloc(arena, job->band_count * taps * sizeof(*job->windows));
+    job->blurred_rows = job->unsharp != NULL ? scratch_arena_alloc(arena, (size_t)job->band_count * width) : NULL;
+    job->row_filter = select_row_filter(job->channel_count, taps, SAMPLE_UINT8, job->intermediate);
+    job->column_filter = select_row_filter(width, taps, job->intermediate, SAMPLE_UINT8);
+    job->rows_filter = select_rows_filter(taps, job->intermediate);
+    job->fixed_kernel = fixed_kernel;
+    if (fixed_kernel == NULL)
+    {
+        return;
+    }
+
+    job->fixed_row_filter = select_fixed_row_filter(job->channel_count, taps, SAMPLE_UINT8, job->intermediate);
+    job->fixed_column_filter = select_fixed_row_filter(width, taps, job->intermediate, SAMPLE_UINT8);
+    job->fixed_rows_filter = select_fixed_rows_filter(taps, job->intermediate);
+}
+
+/*
+ * Border samples are filtered one at a time, but without divisions or per-tap bounds checks. The taps of a
+ * pixel split into three ranges: those left of the row, which repeat the left edge pixel, those inside it,
+ * and those right of it, which repeat the right edge pixel. IGNORE skips the outer ranges. Taps are still
+ * summed in kernel order, so border samples match the SIMD paths exactly.
+ */
+static void tap_range(band_job *job, int column, int *first, int *last)
+{
+    int taps = 2 * job->kernel_radius + 1;
+    int left = job->kernel_radius - column;
+    int right = job->w - 1 - column + job->kernel_radius;
+    *first = left > 0 ? left : 0;
+    *last = right < taps - 1 ? right : taps - 1;
+}
+
+static void filter_samples_horizontal(band_job *job, int y, int x_start, int x_end, unsigned char *filtered_row)
+{
+    int channel_count = job->channel_count;
+    int taps = 2 * job->kernel_radius + 1;
+    int outer_taps = job->overflow_mode == REPEAT;
+    const unsigned char *row = job->image + y * job->w * channel_count;
+    int column = x_start / channel_count;
+    int channel = x_start % channel_count;
+    for (int x = x_start; x < x_end; x++)
+    {
+        int first, last;
+        tap_range(job, column, &first, &last);
+        int tap_start = channel + (column - job->kernel_radius) * channel_count; // Index of tap 0, may be outside the row.
+        unsigned char left = row[channel];
+        unsigned char right = row[(job->w - 1) * channel_count + channel];
+        int k_end = outer_taps ? taps : last + 1;
+        if (job->fixed_kernel != NULL)
+        {
+            int result = 0;
+            for (int k = outer_taps ? 0 : first; k < first; k++)
+            {
+                result += left * job->fixed_kernel[k];
+            }
+
+            for (int k = first; k <= last; k++)
+            {
+                result += row[tap_start + k * channel_count] * job->fixed_kernel[k];
+            }
+
+            for (int k = last + 1; k < k_end; k++)
+            {
+                result += right * job->fixed_kernel[k];
+            }
+
+            if (job->intermediate == SAMPLE_UINT16_8_7)
+            {
+                ((unsigned short *)filtered_row)[x] = fixed_sample(result, 8, 32767);
+            }
+            else
+            {
+                filtered_row[x] = fixed_sample(result, 15, 255);
+            }
+        }
+        else
+        {
+            float result = 0;
+            for (int k = outer_taps ? 0 : first; k < first; k++)
+            {
+                result += left * job->kernel[k];
+            }
+
+            for (int k = first; k <= last; k++)
+            {
+                result += row[tap_start + k * channel_count] * job->kernel[k];
+            }
+
+            for (int k = last + 1; k < k_end; k++)
+            {
+                result += right * job->kernel[k];
+            }
+
+            if (job->intermediate == SAMPLE_UINT16_8_7)
+            {
+                ((unsigned short *)filtered_row)[x] = wide_sample(result);
+            }
+            else
+            {
+                filtered_row[x] = saturate_sample(result);
+            }
+        }
+
+        if (++channel == channel_count)
+        {
+            channel = 0;
+            column++;
+        }
+    }
+}
+
+/* Filters row y of the image horizontally into filtered_row, in the job's intermediate format.*/
+static void filter_row_horizontal(band_job *job, int y, unsigned char *filtered_row)
+{
+    int width = job->w * job->channel_count;
+    int reach = job->kernel_radius * job->channel_count;
+    int interior_start, interior_end;
+    interior_range(width, reach, &interior_start, &interior_end);
+
+    filter_samples_horizontal(job, y, 0, interior_start, filtered_row);
+
+    int x = interior_start;
+    unsigned char *row = job->image + y * width + interior_start - reach;
+    unsigned char *interior = filtered_row + interior_start * (job->intermediate == SAMPLE_UINT8 ? 1 : 2);
+    if (job->fixed_kernel != NULL)
+    {
+        if (job->fixed_row_filter != NULL)
+        {
+            x += job->fixed_row_filter(interior, row, job->channel_count,
+                                       0, interior_end - interior_start, job->fixed_kernel, 2 * job->kernel_radius + 1);
+        }
+    }
+    else if (job->row_filter != NULL)
+    {
+        x += job->row_filter(interior, row, job->channel_count,
+                             0, interior_end - interior_start, job->kernel, 2 * job->kernel_radius + 1);
+    }
+
+    filter_samples_horizontal(job, y, x, width, filtered_row);
+}
+
+/* Scalar tail of rows_filter_fun.*/
+static void filter_samples_rows(unsigned char *filtered, const unsigned char **rows, SampleFormat source, int x_start, int x_end, const float *kernel, int taps)
+{
+    for (int x = x_start; x < x_end; x++)
+    {
+        float result = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            result += load_sample(rows[k], x, source) * kernel[k];
+        }
+
+        filtered[x] = saturate_sample(result);
+    }
+}
+
+/* Scalar tail of fixed_rows_filter_fun.*/
+static void filter_samples_rows_fixed(unsigned char *filtered, const unsigned char **rows, SampleFormat source, int x_start, int x_end, const short *kernel, int taps)
+{
+    int shift = source == SAMPLE_UINT8 ? 15 : 22;
+    for (int x = x_start; x < x_end; x++)
+    {
+        int result = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            result += load_sample(rows[k], x, source) * kernel[k];
+        }
+
+        filtered[x] = fixed_sample(result, shift, 255);
+    }
+}
+
+/* Row that tap row `row` reads: the nearest edge row for REPEAT, or -1 for job->zero_row under IGNORE.*/
+static int window_source_row(band_job *job, int row)
+{
+    if (row >= 0 && row < job->h)
+    {
+        return row;
+    }
+
+    if (job->overflow_mode == IGNORE)
+    {
+        return -1;
+    }
+
+    return row < 0 ? 0 : job->h - 1;
+}
+
+/* Filters filtered_row[x, width) from the rows of its vertical window.*/
+static void filter_window(band_job *job, unsigned char *filtered_row, const unsigned char **rows, int x)
+{
+    int width = job->w * job->channel_count;
+    int taps = 2 * job->kernel_radius + 1;
+    if (job->fixed_kernel != NULL)
+    {
+        if (job->fixed_rows_filter != NULL)
+        {
+            x = job->fixed_rows_filter(filtered_row, rows, x, width, job->fixed_kernel, taps);
+        }
+
+        filter_samples_rows_fixed(filtered_row, rows, job->intermediate, x, width, job->fixed_kernel, taps);
+        return;
+    }
+
+    if (job->rows_filter != NULL)
+    {
+        x = job->rows_filter(filtered_row, rows, x, width, job->vertical_kernel, taps);
+    }
+
+    filter_samples_rows(filtered_row, rows, job->intermediate, x, width, job->vertical_kernel, taps);
+}
+
+/* Writes output row y from its blurred row and row y of the image, which no band has overwritten yet. The float
+   passes truncate, so their blur is half a level low on average for each pass that writes bytes, and gets it back
+   here.*/
+static void unsharp_row(band_job *job, int y, const unsigned char *blurred_row)
+{
+    int width = job->w * job->channel_count;
+    float blur_offset = job->fixed_kernel != NULL ? 0 : (job->intermediate == SAMPLE_UINT8 ? 1 : 0.5f);
+    sharpen_bytes_row(job->filtered + y * width, job->image + y * width, blurred_row, job->unsharp->amount, job->unsharp->threshold, blur_offset, width);
+}
+
+static void filter_band_horizontal(void *arg, int band)
+{
+    band_job *job = arg;
+    size_t row_size = intermediate_row_size(job);
+    int start_row, end_row;
+    band_rows(job, band, &start_row, &end_row);
+
+    for (int y = start_row; y < end_row; y++)
+    {
+        filter_row_horizontal(job, y, job->horizontally_filtered + y * row_size);
+    }
+}
+
+static void filter_band_vertical(void *arg, int band)
+{
+    band_job *job = arg;
+    int width = job->w * job->channel_count;
+    size_t row_size = intermediate_row_size(job);
+    int taps = 2 * job->kernel_radius + 1;
+    int interior_start, interior_end;
+    interior_range(job->h, job->kernel_radius, &interior_start, &interior_end);
+    int start_row, end_row;
+    band_rows(job, band, &start_row, &end_row);
+
+    const unsigned char **rows = job->windows + band * taps;
+    for (int y = start_row; y < end_row; y++)
+    {
+        for (int k = 0; k < taps; k++)
+        {
+            int source = window_source_row(job, y - job->kernel_radius + k);
+            rows[k] = source < 0 ? job->zero_row : job->horizontally_filtered + source * row_size;
+        }
+
+        // Interior rows are evenly spaced, so they take the strided filter; its tail and border rows use the window.
+        int x = 0;
+        int interior = y >= interior_start && y < interior_end;
+        unsigned char *filtered_row = job->unsharp != NULL ? job->blurred_rows + band * width : job->filtered + y * width;
+        if (interior && job->fixed_kernel != NULL && job->fixed_column_filter != NULL)
+        {
+            x = job->fixed_column_filter(filtered_row, rows[0], width, 0, width, job->fixed_kernel, taps);
+        }
+        else if (interior && job->fixed_kernel == NULL && job->column_filter != NULL)
+        {
+            x = job->column_filter(filtered_row, rows[0], width, 0, width, job->vertical_kernel, taps);
+        }
+
+        filter_window(job, filtered_row, rows, x);
+        if (job->unsharp != NULL)
+        {
+            unsharp_row(job, y, filtered_row);
+        }
+    }
+}
+
+static void run_separable(scratch_arena *arena, unsigned char *filtered, unsigned char *horizontally_filtered, unsigned char *image, int w, int h, float *kernel, const short *fixed_kernel, IntermediateFormat intermediate, int kernel_radius, int channel_count, OverflowMode overflow_mode, int threads, const unsharp_params *unsharp)
+{
+    band_job job = {filtered, horizontally_filtered, image, w, h, kernel, kernel_radius, channel_count, overflow_mode};
+    job.unsharp = unsharp;
+    job.first_row = 0;
+    job.row_count = h;
+    job.band_count = band_count_for(threads, h);
+    band_job_prepare(&job, arena, fixed_kernel, intermediate);
+
+    // The vertical pass reads rows of every band, so it starts only after the horizontal pass has finished.
+    thread_pool_run(threads, &filter_band_horizontal, &job, job.band_count);
+    thread_pool_run(threads, &filter_band_vertical, &job, job.band_count);
+}
+
+void filter_image_separable(unsigned char **filtered, unsigned char **horizontally_filtered, unsigned char **image, int w, int h, float **kernel, const short *fixed_kernel, IntermediateFormat intermediate, int kernel_radius, int channel_count, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    run_separable(&arena, *filtered, *horizontally_filtered, *image, w, h, *kernel, fixed_kernel, intermediate, kernel_radius, channel_count, overflow_mode, threads, NULL);
+    scratch_arena_release(&arena);
+}
+
+/*
+ * The fused pass keeps a ring buffer of 2r+1 horizontally filtered rows per band and emits each output
+ * row as soon as its window is complete. A band also needs the r rows on either side of it, which its
+ * neighbours overwrite when filtering in place, so those halos are filtered up front before any band
+ * starts writing.
+ */
+static void fused_halo_rows(band_job *job, int band, int *top_start, int *bottom_end)
+{
+    int start_row, end_row;
+    band_rows(job, band, &start_row, &end_row);
+    *top_start = start_row - job->kernel_radius > 0 ? start_row - job->kernel_radius : 0;
+    *bottom_end = end_row + job->kernel_radius < job->h ? end_row + job->kernel_radius : job->h;
+}
+
+static void fused_band_halos(void *arg, int band)
+{
+    band_job *job = arg;
+    fused_band *state = &job->fused_bands[band];
+    size_t row_size = intermediate_row_size(job);
+    int start_row, end_row, top_start, bottom_end;
+    band_rows(job, band, &start_row, &end_row);
+    fused_halo_rows(job, band, &top_start, &bottom_end);
+
+    for (int y = top_start; y < start_row; y++)
+    {
+        filter_row_horizontal(job, y, state->top_halo + (y - top_start) * row_size);
+    }
+
+    for (int y = end_row; y < bottom_end; y++)
+    {
+        filter_row_horizontal(job, y, state->bottom_halo + (y - end_row) * row_size);
+    }
+}
+
+static void fused_band_filter(void *arg, int band)
+{
+    band_job *job = arg;
+    fused_band *state = &job->fused_bands[band];
+    int kernel_radius = job->kernel_radius;
+    int taps = 2 * kernel_radius + 1;
+    int width = job->w * job->channel_count;
+    size_t row_size = intermediate_row_size(job);
+    int start_row, end_row, top_start, bottom_end;
+    band_rows(job, band, &start_row, &end_row);
+    fused_halo_rows(job, band, &top_start, &bottom_end);
+
+    const unsigned char **rows = job->windows + band * taps;
+    int next_row = start_row;
+    for (int y = start_row; y < end_row; y++)
+    {
+        int last_needed = y + kernel_radius < end_row ? y + kernel_radius : end_row - 1;
+        for (; next_row <= last_needed; next_row++)
+        {
+            filter_row_horizontal(job, next_row, state->ring + (next_row % taps) * row_size);
+        }
+
+        for (int k = 0; k < taps; k++)
+        {
+            int source = window_source_row(job, y - kernel_radius + k);
+            if (source < 0)
+            {
+                rows[k] = job->zero_row;
+            }
+            else if (source < start_row)
+            {
+                rows[k] = state->top_halo + (source - top_start) * row_size;
+            }
+            else if (source >= end_row)
+            {
+                rows[k] = state->bottom_halo + (source - end_row) * row_size;
+            }
+            else
+            {
+                rows[k] = state->ring + (source % taps) * row_size;
+            }
+        }
+
+        if (job->unsharp != NULL)
+        {
+            filter_window(job, job->blurred_rows + band * width, rows, 0);
+            unsharp_row(job, y, job->blurred_rows + band * width);
+        }
+        else
+        {
+            filter_window(job, job->filtered + y * width, rows, 0);
+        }
+    }
+}
+
+static void run_separable_fused(scratch_arena *arena, unsigned char *filtered, unsigned char *image, int w, int h, float *kernel, const short *fixed_kernel, IntermediateFormat intermediate, int kernel_radius, int channel_count, OverflowMode overflow_mode, int threads, const unsharp_params *unsharp)
+{
+    band_job job = {filtered, NULL, image, w, h, kernel, kernel_radius, channel_count, overflow_mode};
+    job.unsharp = unsharp;
+
+    // One band per thread, as every band filters its halos horizontally a second time.
+    job.first_row = 0;
+    job.row_count = h;
+    job.band_count = threads > 0 ? threads : thread_pool_available_threads();
+    job.band_count = job.band_count < h ? job.band_count : (h > 0 ? h : 1);
+    band_job_prepare(&job, arena, fixed_kernel, intermediate);
+
+    size_t row_size = intermediate_row_size(&job);
+    job.fused_bands = scratch_arena_alloc(arena, job.band_count * sizeof(fused_band));
+    for (int band = 0; band < job.band_count; band++)
+    {
+        int start_row, end_row, top_start, bottom_end;
+        band_rows(&job, band, &start_row, &end_row);
+        fused_halo_rows(&job, band, &top_start, &bottom_end);
+        job.fused_bands[band].ring = scratch_arena_alloc(arena, (2 * kernel_radius + 1) * row_size);
+        job.fused_bands[band].top_halo = scratch_arena_alloc(arena, (start_row - top_start) * row_size);
+        job.fused_bands[band].bottom_halo = scratch_arena_alloc(arena, (bottom_end - end_row) * row_size);
+    }
+
+    thread_pool_run(threads, &fused_band_halos, &job, job.band_count);
+    thread_pool_run(threads, &fused_band_filter, &job, job.band_count);
+}
+
+void filter_image_separable_fused(unsigned char **filtered, unsigned char **image, int w, int h, float **kernel, const short *fixed_kernel, IntermediateFormat intermediate, int kernel_radius, int channel_count, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    run_separable_fused(&arena, *filtered, *image, w, h, *kernel, fixed_kernel, intermediate, kernel_radius, channel_count, overflow_mode, threads, NULL);
+    scratch_arena_release(&arena);
+}
+
+/* (sum + offset) / window. An offset of 0.5 truncates like the float path while keeping float error away from
+   integer boundaries, an offset of radius + 0.5 rounds to nearest.*/
+static unsigned char box_average(unsigned int sum, float offset, float inverse_window)
+{
+    return (sum + offset) * inverse_window;
+}
+
+/* Reads pixel `pixel` of one channel of a row, repeating the edge pixel or reading zero outside it.*/
+static unsigned int box_edge_sample(const unsigned char *channel_row, int pixel, int w, int channel_count, OverflowMode overflow_mode)
+{
+    if (pixel >= 0 && pixel < w)
+    {
+        return channel_row[pixel * channel_count];
+    }
+
+    if (overflow_mode == IGNORE)
+    {
+        return 0;
+    }
+
+    return channel_row[pixel < 0 ? 0 : (w - 1) * channel_count];
+}
+
+/* Row y of the intermediate, the edge row repeated outside the image, or NULL for rows that are ignored.*/
+static unsigned char *box_edge_row(band_job *job, int y)
+{
+    if (y < 0 || y >= job->h)
+    {
+        if (job->overflow_mode == IGNORE)
+        {
+            return NULL;
+        }
+
+        y = y < 0 ? 0 : job->h - 1;
+    }
+
+    return job->horizontally_filtered + y * job->w * job->channel_count;
+}
+
+static void box_band_horizontal(void *arg, int band)
+{
+    band_job *job = arg;
+    int w = job->w;
+    int kernel_radius = job->kernel_radius;
+    int channel_count = job->channel_count;
+    float inverse_window = 1.0f / (2 * kernel_radius + 1);
+    // Pixels whose entering and leaving samples both lie inside the row.
+    int interior_start = kernel_radius + 1 < w ? kernel_radius + 1 : w;
+    int interior_end = w - kernel_radius > interior_start ? w - kernel_radius : interior_start;
+    int start_row, end_row;
+    band_rows(job, band, &start_row, &end_row);
+
+    for (int y = start_row; y < end_row; y++)
+    {
+        for (int c = 0; c < channel_count; c++)
+        {
+            unsigned char *row = job->image + y * w * channel_count + c;
+            unsigned char *filtered_row = job->horizontally_filtered + y * w * channel_count + c;
+
+            unsigned int sum = 0;
+            for (int p = -kernel_radius; p <= kernel_radius; p++)
+            {
+                sum += box_edge_sample(row, p, w, channel_count, job->overflow_mode);
+            }
+
+            filtered_row[0] = box_average(sum, job->average_offset, inverse_window);
+
+            // Only the strips where the window sticks out of the row pay for the bounds checks.
+            int p = 1;
+            for (; p < interior_start; p++)
+            {
+                sum += box_edge_sample(row, p + kernel_radius, w, channel_count, job->overflow_mode) -
+                       box_edge_sample(row, p - kernel_radius - 1, w, channel_count, job->overflow_mode);
+                filtered_row[p * channel_count] = box_average(sum, job->average_offset, inverse_window);
+            }
+
+            for (; p < interior_end; p++)
+            {
+                sum += row[(p + kernel_radius) * channel_count] - row[(p - kernel_radius - 1) * channel_count];
+                filtered_row[p * channel_count] = box_average(sum, job->average_offset, inverse_window);
+            }
+
+            for (; p < w; p++)
+            {
+                sum += box_edge_sample(row, p + kernel_radius, w, channel_count, job->overflow_mode) -
+                       box_edge_sample(row, p - kernel_radius - 1, w, channel_count, job->overflow_mode);
+                filtered_row[p * channel_count] = box_average(sum, job->average_offset, inverse_window);
+            }
+        }
+    }
+}
+
+/* Every band primes its own column sums from its first window, so bands need no state from each other.*/
+static void box_band_vertical(void *arg, int band)
+{
+    band_job *job = arg;
+    int kernel_radius = job->kernel_radius;
+    int width = job->w * job->channel_count;
+    float inverse_window = 1.0f / (2 * kernel_radius + 1);
+    int start_row, end_row;
+    band_rows(job, band, &start_row, &end_row);
+    if (start_row >= end_row)
+    {
+        return;
+    }
+
+    unsigned int *column_sums = job->column_sums + (size_t)band * width;
+    memset(column_sums, 0, width * sizeof(unsigned int));
+    for (int y = start_row - kernel_radius; y <= start_row + kernel_radius; y++)
+    {
+        unsigned char *row = box_edge_row(job, y);
+        for (int x = 0; row != NULL && x < width; x++)
+        {
+            column_sums[x] += row[x];
+        }
+    }
+
+    for (int y = start_row; y < end_row; y++)
+    {
+        unsigned char *filtered_row = job->filtered + y * width;
+        for (int x = 0; x < width; x++)
+        {
+            filtered_row[x] = box_average(column_sums[x], job->average_offset, inverse_window);
+        }
+
+        if (y + 1 == end_row)
+        {
+            break;
+        }
+
+        unsigned char *entering = box_edge_row(job, y + kernel_radius + 1);
+        unsigned char *leaving = box_edge_row(job, y - kernel_radius);
+        for (int x = 0; entering != NULL && x < width; x++)
+        {
+            column_sums[x] += entering[x];
+        }
+
+        for (int x = 0; leaving != NULL && x < width; x++)
+        {
+            column_sums[x] -= leaving[x];
+        }
+    }
+}
+
+static void run_box(scratch_arena *arena, unsigned char *filtered, unsigned char *horizontally_filtered, unsigned char *image, int w, int h, int kernel_radius, int channel_count, OverflowMode overflow_mode, int threads, float average_offset)
+{
+    band_job job = {filtered, horizontally_filtered, image, w, h, NULL, kernel_radius, channel_count, overflow_mode};
+
+    job.average_offset = average_offset;
+    job.first_row = 0;
+    job.row_count = h;
+    job.band_count = band_count_for(threads, h);
+    size_t mark = arena->used;
+    job.column_sums = scratch_arena_alloc(arena, (size_t)job.band_count * w * channel_count * sizeof(unsigned int));
+    thread_pool_run(threads, &box_band_horizontal, &job, job.band_count);
+    thread_pool_run(threads, &box_band_vertical, &job, job.band_count);
+    scratch_arena_rewind(arena, mark);
+}
+
+void filter_image_box(unsigned char **filtered, unsigned char **horizontally_filtered, unsigned char **image, int w, int h, int kernel_radius, int channel_count, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    run_box(&arena, *filtered, *horizontally_filtered, *image, w, h, kernel_radius, channel_count, overflow_mode, threads, 0.5f);
+    scratch_arena_release(&arena);
+}
+
+void box_approximation_radii(int *radii, float sigma, int passes)
+{
+    // Boxes of widths wl and wl + 2 whose variances (w^2 - 1) / 12 add up to sigma^2.
+    double ideal_width = sqrt(12.0 * sigma * sigma / passes + 1);
+    int lower_width = floor(ideal_width);
+    if (lower_width % 2 == 0)
+    {
+        lower_width--;
+    }
+
+    double ideal_lower_count = (12.0 * sigma * sigma - passes * lower_width * lower_width - 4.0 * passes * lower_width - 3.0 * passes) / (-4.0 * lower_width - 4);
+    int lower_count = round(ideal_lower_count);
+    for (int i = 0; i < passes; i++)
+    {
+        int width = i < lower_count ? lower_width : lower_width + 2;
+        radii[i] = (width - 1) / 2;
+    }
+}
+
+static void run_box_approx_gaussian(scratch_arena *arena, unsigned char *image, int w, int h, int channel_count, float sigma, int passes, OverflowMode overflow_mode, int threads)
+{
+    passes = passes < 3 ? 3 : (passes > 5 ? 5 : passes);
+    int radii[5];
+    box_approximation_radii(radii, sigma, passes);
+
+    // Every pass extends the image past its edges again, with zeros under IGNORE, which drops what earlier passes
+    // spread out of the image and darkens the borders with each pass, and with the edge pixels under REPEAT, which
+    // replaces the blurred spill-over with the blurred edge. Run the passes over the image padded by their total
+    // reach instead, which gives the stacked boxes of the extended image exactly, and crop once.
+    size_t mark = arena->used;
+    int reach = 0;
+    for (int i = 0; i < passes; i++)
+    {
+        reach += radii[i];
+    }
+
+    int padded_w = w + 2 * reach, padded_h = h + 2 * reach;
+    int width = w * channel_count, padded_width = padded_w * channel_count;
+    unsigned char *padded = image;
+    if (reach > 0)
+    {
+        padded = scratch_arena_alloc(arena, (size_t)padded_width * padded_h);
+        for (int y = 0; y < padded_h; y++)
+        {
+            int source_y = y - reach < 0 ? 0 : (y - reach >= h ? h - 1 : y - reach);
+            int outside = y < reach || y >= h + reach;
+            unsigned char *source = image + (size_t)source_y * width;
+            unsigned char *row = padded + (size_t)y * padded_width;
+            for (int x = 0; x < padded_w; x++)
+            {
+                int source_x = x - reach < 0 ? 0 : (x - reach >= w ? w - 1 : x - reach);
+                int zero = overflow_mode == IGNORE && (outside || source_x != x - reach);
+                for (int c = 0; c < channel_count; c++)
+                {
+                    row[x * channel_count + c] = zero ? 0 : source[source_x * channel_count + c];
+                }
+            }
+        }
+    }
+
+    // Every pass rounds, so the passes do not add up a truncation bias.
+    unsigned char *horizontally_filtered = scratch_arena_alloc(arena, (size_t)padded_width * padded_h);
+    for (int i = 0; i < passes; i++)
+    {
+        if (radii[i] > 0)
+        {
+            run_box(arena, padded, horizontally_filtered, padded, padded_w, padded_h, radii[i], channel_count, overflow_mode, threads, radii[i] + 0.5f);
+        }
+    }
+
+    for (int y = 0; reach > 0 && y < h; y++)
+    {
+        memcpy(image + (size_t)y * width, padded + (size_t)(y + reach) * padded_width + reach * channel_count, width);
+    }
+
+    scratch_arena_rewind(arena, mark);
+}
+
+void filter_image_box_approx_gaussian(unsigned char **image, int w, int h, int channel_count, float sigma, int passes, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    run_box_approx_gaussian(&arena, *image, w, h, channel_count, sigma, passes, overflow_mode, threads);
+    scratch_arena_release(&arena);
+}
+
+/* Coefficients of the recursive Gaussian of Young and van Vliet (1995), normalized by b0, with the boundary matrix of
+   Triggs and Sdika (2006): the anti-causal state past the right edge per unit deviation of the last three causal
+   outputs from the steady state.*/
+typedef struct iir_coefficients
+{
+    double b;
+    double a1;
+    double a2;
+    double a3;
+    double boundary[3][3];
+} iir_coefficients;
+
+/* Fills in the boundary matrix by running the causal recursion on past the edge from each unit deviation until it
+   has died out, then the anti-causal one back over it. The slowest pole decays over about q samples.*/
+static void iir_boundary_matrix(iir_coefficients *c, double q)
+{
+    int count = 40 * (int)ceil(q + 1) + 3;
+    double *tail = malloc(count * sizeof(double));
+    for (int j = 0; j < 3; j++)
+    {
+        double w1 = j == 0, w2 = j == 1, w3 = j == 2;
+        for (int n = 0; n < count; n++)
+        {
+            tail[n] = c->a1 * w1 + c->a2 * w2 + c->a3 * w3;
+            w3 = w2, w2 = w1, w1 = tail[n];
+        }
+
+        double y1 = 0, y2 = 0, y3 = 0;
+        for (int n = count - 1; n >= 0; n--)
+        {
+            double y0 = c->b * tail[n] + c->a1 * y1 + c->a2 * y2 + c->a3 * y3;
+            if (n < 3)
+            {
+                c->boundary[n][j] = y0;
+            }
+
+            y3 = y2, y2 = y1, y1 = y0;
+        }
+    }
+
+    free(tail);
+}
+
+static iir_coefficients iir_gaussian_coefficients(float sigma)
+{
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    double b3 = 0.422205 * q * q * q;
+
+    iir_coefficients coefficients = {1 - (b1 + b2 + b3) / b0, b1 / b0, b2 / b0, b3 / b0};
+    iir_boundary_matrix(&coefficients, q);
+    return coefficients;
+}
+
+/* Columns per task of the vertical IIR pass. Neighbouring columns are independent, so the compiler can
+   vectorize across a strip.*/
+#define IIR_STRIP_WIDTH 64
+
+typedef struct iir_job
+{
+    unsigned char *image;
+    int w;
+    int h;
+    int channel_count;
+    iir_coefficients coefficients;
+    OverflowMode overflow_mode;
+    int band_count;
+    int strip_count;
+    int strip_task_count;
+    double *scratch; // A row per band, then a strip of columns per strip task.
+} iir_job;
+
+static unsigned char round_sample(double result)
+{
+    return saturate_sample(result + 0.5);
+}
+
+/* Anti-causal state y[n], y[n + 1], y[n + 2] just past the right edge, from the last three causal outputs w1, w2, w3,
+   for an input that stays at edge beyond it.*/
+static void iir_right_boundary(const iir_coefficients *c, double w1, double w2, double w3, double edge, double *y)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        y[i] = edge + c->boundary[i][0] * (w1 - edge) + c->boundary[i][1] * (w2 - edge) + c->boundary[i][2] * (w3 - edge);
+    }
+}
+
+/* Causal then anti-causal pass over count samples spaced by stride. Large sigmas put the poles close to 1, so the
+   recursion runs in double precision.
+   The image continues with its edge samples under REPEAT and with zeros under IGNORE. The causal recursion starts
+   in the steady state of that, and the anti-causal one from the boundary matrix.*/
+static void iir_filter_line(unsigned char *line, int count, int stride, double *scratch, const iir_coefficients *c, OverflowMode overflow_mode)
+{
+    double edge = overflow_mode == REPEAT ? line[0] : 0;
+    double w1 = edge, w2 = edge, w3 = edge;
+    for (int n = 0; n < count; n++)
+    {
+        double w0 = c->b * line[n * stride] + c->a1 * w1 + c->a2 * w2 + c->a3 * w3;
+        scratch[n] = w0;
+        w3 = w2, w2 = w1, w1 = w0;
+    }
+
+    double y[3];
+    iir_right_boundary(c, w1, w2, w3, overflow_mode == REPEAT ? line[(count - 1) * stride] : 0, y);
+    double y1 = y[0], y2 = y[1], y3 = y[2];
+    for (int n = count - 1; n >= 0; n--)
+    {
+        double y0 = c->b * scratch[n] + c->a1 * y1 + c->a2 * y2 + c->a3 * y3;
+        line[n * stride] = round_sample(y0);
+        y3 = y2, y2 = y1, y1 = y0;
+    }
+}
+
+static void iir_band_horizontal(void *arg, int band)
+{
+    iir_job *job = arg;
+    int width = job->w * job->channel_count;
+    int start_row = (int)((long)job->h * band / job->band_count);
+    int end_row = (int)((long)job->h * (band + 1) / job->band_count);
+
+    double *scratch = job->scratch + (size_t)band * job->w;
+    for (int y = start_row; y < end_row; y++)
+    {
+        for (int c = 0; c < job->channel_count; c++)
+        {
+            iir_filter_line(job->image + y * width + c, job->w, job->channel_count, scratch, &job->coefficients, job->overflow_mode);
+        }
+    }
+}
+
+/* Doubles of scratch a strip of columns needs.*/
+static size_t iir_strip_scratch_size(int h)
+{
+    return (size_t)(h + 6) * IIR_STRIP_WIDTH;
+}
+
+/* Filters a strip of columns top to bottom and back, one row of the strip at a time.*/
+static void iir_filter_strip(iir_job *job, int strip, double *scratch)
+{
+    const iir_coefficients *c = &job->coefficients;
+    int width = job->w * job->channel_count;
+    int h = job->h;
+    int x0 = strip * IIR_STRIP_WIDTH;
+    int columns = width - x0 < IIR_STRIP_WIDTH ? width - x0 : IIR_STRIP_WIDTH;
+
+    // Three rows of history in front of the strip, so the recursion needs no special case at the edge.
+    double *w = scratch + 3 * IIR_STRIP_WIDTH;
+    for (int x = 0; x < columns; x++)
+    {
+        double edge = job->overflow_mode == REPEAT ? job->image[x0 + x] : 0;
+        w[x - IIR_STRIP_WIDTH] = w[x - 2 * IIR_STRIP_WIDTH] = w[x - 3 * IIR_STRIP_WIDTH] = edge;
+    }
+
+    for (int y = 0; y < h; y++)
+    {
+        unsigned char *row = job->image + y * width + x0;
+        double *w0 = w + y * IIR_STRIP_WIDTH;
+        for (int x = 0; x < columns; x++)
+        {
+            w0[x] = c->b * row[x] + c->a1 * w0[x - IIR_STRIP_WIDTH] + c->a2 * w0[x - 2 * IIR_STRIP_WIDTH] + c->a3 * w0[x - 3 * IIR_STRIP_WIDTH];
+        }
+    }
+
+    // The anti-causal pass overwrites w in place, with three rows of history after the strip. Strips shorter than
+    // three rows read the history in front of them.
+    for (int x = 0; x < columns; x++)
+    {
+        double edge = job->overflow_mode == REPEAT ? job->image[(h - 1) * width + x0 + x] : 0;
+        double y[3];
+        iir_right_boundary(c, w[(h - 1) * IIR_STRIP_WIDTH + x], w[(h - 2) * IIR_STRIP_WIDTH + x], w[(h - 3) * IIR_STRIP_WIDTH + x], edge, y);
+        w[h * IIR_STRIP_WIDTH + x] = y[0];
+        w[(h + 1) * IIR_STRIP_WIDTH + x] = y[1];
+        w[(h + 2) * IIR_STRIP_WIDTH + x] = y[2];
+    }
+
+    for (int y = h - 1; y >= 0; y--)
+    {
+        unsigned char *row = job->image + y * width + x0;
+        double *y0 = w + y * IIR_STRIP_WIDTH;
+        for (int x = 0; x < columns; x++)
+        {
+            y0[x] = c->b * y0[x] + c->a1 * y0[x + IIR_STRIP_WIDTH] + c->a2 * y0[x + 2 * IIR_STRIP_WIDTH] + c->a3 * y0[x + 3 * IIR_STRIP_WIDTH];
+            row[x] = round_sample(y0[x]);
+        }
+    }
+}
+
+/* Strips all cost the same, so every task takes every strip_task_count-th strip and keeps one strip of scratch.*/
+static void iir_strips_vertical(void *arg, int task)
+{
+    iir_job *job = arg;
+    double *scratch = job->scratch + (size_t)job->band_count * job->w + task * iir_strip_scratch_size(job->h);
+    for (int strip = task; strip < job->strip_count; strip += job->strip_task_count)
+    {
+        iir_filter_strip(job, strip, scratch);
+    }
+}
+
+static void run_gaussian_iir(scratch_arena *arena, unsigned char *image, int w, int h, int channel_count, float sigma, OverflowMode overflow_mode, int threads)
+{
+    if (sigma < 0.5f || w <= 0 || h <= 0)
+    {
+        return;
+    }
+
+    iir_job job = {image, w, h, channel_count, iir_gaussian_coefficients(sigma), overflow_mode};
+
+    // Rows are filtered in row bands, then columns in strips, each in place.
+    job.band_count = band_count_for(threads, h);
+    job.strip_count = (w * channel_count + IIR_STRIP_WIDTH - 1) / IIR_STRIP_WIDTH;
+    job.strip_task_count = threads > 0 ? threads : thread_pool_available_threads();
+    job.strip_task_count = job.strip_task_count < job.strip_count ? job.strip_task_count : job.strip_count;
+    job.scratch = scratch_arena_alloc(arena, ((size_t)job.band_count * w + job.strip_task_count * iir_strip_scratch_size(h)) * sizeof(double));
+    thread_pool_run(threads, &iir_band_horizontal, &job, job.band_count);
+    thread_pool_run(threads, &iir_strips_vertical, &job, job.strip_task_count);
+}
+
+void filter_image_gaussian_iir(unsigned char **image, int w, int h, int channel_count, float sigma, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    run_gaussian_iir(&arena, *image, w, h, channel_count, sigma, overflow_mode, threads);
+    scratch_arena_release(&arena);
+}
+
+/* Plane and pixel pointers of the rows of one band. The planar buffer is job->filtered when planar_output is set
+   and job->image otherwise; the interleaved one is the other.*/
+static void band_planes(band_job *job, int band, int planar_output, unsigned char **planes, unsigned char **pixels, int *count)
+{
+    int start_row, end_row;
+    band_rows(job, band, &start_row, &end_row);
+    unsigned char *planar = planar_output ? job->filtered : job->image;
+    for (int channel = 0; channel < job->channel_count; channel++)
+    {
+        planes[channel] = planar + ((size_t)channel * job->h + start_row) * job->w;
+    }
+
+    *pixels = (planar_output ? job->image : job->filtered) + (size_t)start_row * job->w * job->channel_count;
+    *count = (end_row - start_row) * job->w;
+}
+
+static void deinterleave_band(void *arg, int band)
+{
+    band_job *job = arg;
+    unsigned char *planes[job->channel_count];
+    unsigned char *pixels;
+    int count;
+    band_planes(job, band, 1, planes, &pixels, &count);
+    deinterleave_pixels(planes, pixels, count, job->channel_count);
+}
+
+static void interleave_band(void *arg, int band)
+{
+    band_job *job = arg;
+    unsigned char *planes[job->channel_count];
+    unsigned char *pixels;
+    int count;
+    band_planes(job, band, 0, planes, &pixels, &count);
+    interleave_pixels(pixels, (const unsigned char *const *)planes, count, job->channel_count);
+}
+
+void deinterleave_image(unsigned char **planar, unsigned char **image, int w, int h, int channel_count, int threads)
+{
+    band_job job = {*planar, NULL, *image, w, h, NULL, 0, channel_count};
+    job.first_row = 0;
+    job.row_count = h;
+    job.band_count = band_count_for(threads, h);
+    thread_pool_run(threads, &deinterleave_band, &job, job.band_count);
+}
+
+void interleave_image(unsigned char **image, unsigned char **planar, int w, int h, int channel_count, int threads)
+{
+    band_job job = {*image, NULL, *planar, w, h, NULL, 0, channel_count};
+    job.first_row = 0;
+    job.row_count = h;
+    job.band_count = band_count_for(threads, h);
+    thread_pool_run(threads, &interleave_band, &job, job.band_count);
+}
+
+/* round(color * alpha / 255) without a division.*/
+static unsigned char multiply_alpha(unsigned int color, unsigned int alpha)
+{
+    unsigned int product = color * alpha + 128;
+    return (product + (product >> 8)) >> 8;
+}
+
+/* 255 / alpha in 16.16 fixed point, so un-premultiplying takes a multiplication instead of a division per channel.
+   Rounding the scale up makes the result match round(color * 255 / alpha) for every color and alpha.*/
+static unsigned int unpremultiply_scale[256];
+static pthread_once_t unpremultiply_scale_once = PTHREAD_ONCE_INIT;
+
+static void fill_unpremultiply_scale(void)
+{
+    for (int alpha = 1; alpha < 256; alpha++)
+    {
+        unpremultiply_scale[alpha] = (255u * 65536 + alpha - 1) / alpha;
+    }
+}
+
+static void premultiply_band(void *arg, int band)
+{
+    band_job *job = arg;
+    int start_row, end_row;
+    band_rows(job, band, &start_row, &end_row);
+    unsigned char *pixel = job->image + (size_t)start_row * job->w * 4;
+    unsigned char *end = job->image + (size_t)end_row * job->w * 4;
+    for (; pixel < end; pixel += 4)
+    {
+        pixel[0] = multiply_alpha(pixel[0], pixel[3]);
+        pixel[1] = multiply_alpha(pixel[1], pixel[3]);
+        pixel[2] = multiply_alpha(pixel[2], pixel[3]);
+    }
+}
+
+static void unpremultiply_band(void *arg, int band)
+{
+    band_job *job = arg;
+    int start_row, end_row;
+    band_rows(job, band, &start_row, &end_row);
+    unsigned char *pixel = job->image + (size_t)start_row * job->w * 4;
+    unsigned char *end = job->image + (size_t)end_row * job->w * 4;
+    for (; pixel < end; pixel += 4)
+    {
+        // Blurring can leave a color above its alpha, so results saturate.
+        unsigned int scale = unpremultiply_scale[pixel[3]];
+        for (int channel = 0; channel < 3; channel++)
+        {
+            unsigned int color = (pixel[channel] * scale + 32768) >> 16;
+            pixel[channel] = color > 255 ? 255 : color;
+        }
+    }
+}
+
+static void run_alpha_bands(unsigned char *image, int w, int h, int threads, void (*task)(void *arg, int band))
+{
+    band_job job = {NULL, NULL, image, w, h, NULL, 0, 4};
+    job.first_row = 0;
+    job.row_count = h;
+    job.band_count = band_count_for(threads, h);
+    thread_pool_run(threads, task, &job, job.band_count);
+}
+
+void premultiply_alpha(unsigned char **image, int w, int h, int threads)
+{
+    run_alpha_bands(*image, w, h, threads, &premultiply_band);
+}
+
+void unpremultiply_alpha(unsigned char **image, int w, int h, int threads)
+{
+    pthread_once(&unpremultiply_scale_once, &fill_unpremultiply_scale);
+    run_alpha_bands(*image, w, h, threads, &unpremultiply_band);
+}
+
+void pad_image(unsigned char **image, unsigned char **padded, int original_w, int original_h, int padding, int channel_count, OverflowMode overflow_mode)
+{
+    int padding_left = padding * channel_count / 2;
+    int padding_top = padding / 2;
+    int padded_width = (original_w + padding) * channel_count;
+    int padded_height = original_h + padding;
+    int padded_image_start = padded_width * padding_top + padding_left;
+
+    for (int row = 0; row < original_h; row++)
+    {
+        unsigned char *image_row = *image + row * original_w * channel_count;
+
+        for (int i = 0; i < original_w * channel_count; i++)
+        {
+            (*padded)[padded_image_start + padded_width * row + i] = image_row[i];
+        }
+
+        if (overflow_mode == REPEAT)
+        {
+            for (int i = 0; i < padding / 2; i++)
+            {
+                for (int c = 0; c < channel_count; c++)
+                {
+                    int color_offset = i * channel_count + c;
+                    (*padded)[padded_image_start - padding_left + padded_width * row + color_offset] = image_row[c];
+                    (*padded)[padded_image_start - padding_left + padded_width * (row + 1) - padding_left + color_offset] = image_row[original_w * channel_count - channel_count + c];
+                }
+            }
+
+            if (row > 0 && row < original_h - 1)
+            {
+                continue; // Only repeat pixels horizontally on top and bottom.
+            }
+
+            for (int col = 0; col < padded_width; col++)
+            {
+                for (int i = 0; i < padding / 2; i++)
+                {
+                    (*padded)[col + padded_width * i] = (*padded)[padded_image_start - padding_left + col];
+                    (*padded)[padded_width * padded_height - col - padded_width * i] = (*padded)[padded_width * padded_height - padded_image_start - col];
+                }
+            }
+        }
+    }
+}
+
+void unpad_image(unsigned char **padded, unsigned char **image, int original_w, int original_h, int padding, int channel_count)
+{
+    for (unsigned char *image_ptr = *image; image_ptr < *image + original_w * channel_count * original_h; image_ptr += original_w * channel_count)
+    {
+        int row = (image_ptr - *image) / (original_w * channel_count);
+        int padded_width = (original_w + padding) * channel_count;
+        int padded_image_start = padded_width * padding / 2 + channel_count * padding / 2;
+        memcpy(
+            image_ptr,
+            *padded + padded_image_start + padded_width * row,
+            original_w * channel_count);
+    }
+}
+
+int create_1d_fixed_kernel(short **fixed_kernel, float **kernel, int radius)
+{
+    int taps = 2 * radius + 1;
+    double float_sum = 0;
+    long fixed_sum = 0;
+    for (int i = 0; i < taps; i++)
+    {
+        long weight = lround((*kernel)[i] * 32768.0);
+        if (weight < -32767 || weight > 32767)
+        {
+            return 0;
+        }
+
+        (*fixed_kernel)[i] = weight;
+        float_sum += (*kernel)[i];
+        fixed_sum += weight;
+    }
+
+    // Put the rounding error on the center tap, so a kernel summing to 1 keeps flat regions exact.
+    long center = (*fixed_kernel)[radius] + lround(float_sum * 32768.0) - fixed_sum;
+    if (center < -32767 || center > 32767)
+    {
+        return 0;
+    }
+
+    (*fixed_kernel)[radius] = center;
+
+    // The accumulator must hold 255 times the sum of the weight magnitudes plus the rounding bias.
+    long magnitude = 0;
+    for (int i = 0; i < taps; i++)
+    {
+        magnitude += labs((*fixed_kernel)[i]);
+    }
+
+    return magnitude <= (INT_MAX - (1 << 14)) / 255;
+}
+
+float box_kernel_fun(int i, int radius)
+{
+    return 1.0 / (2 * radius + 1);
+}
+
+void create_disc_kernel(float *kernel, int radius)
+{
+    // Coverage is counted on a 4x4 grid of points per pixel, so the rim is antialiased.
+    int taps = 2 * radius + 1;
+    double sum = 0;
+    for (int j = -radius; j <= radius; j++)
+    {
+        for (int i = -radius; i <= radius; i++)
+        {
+            int inside = 0;
+            for (int v = 0; v < 4; v++)
+            {
+                for (int u = 0; u < 4; u++)
+                {
+                    float x = i + (u - 1.5f) / 4, y = j + (v - 1.5f) / 4;
+                    inside += x * x + y * y <= (radius + 0.5f) * (radius + 0.5f);
+                }
+            }
+
+            kernel[(j + radius) * taps + i + radius] = inside;
+            sum += inside;
+        }
+    }
+
+    for (int i = 0; i < taps * taps; i++)
+    {
+        kernel[i] /= sum;
+    }
+}
+
+/* Standard deviation gaussian_kernel_fun uses for a radius.*/
+static float gaussian_std_dev(int radius)
+{
+    return ceilf((float)radius / 3);
+}
+
+float gaussian_kernel_fun(int i, int radius)
+{
+    int std_dev = gaussian_std_dev(radius);
+    if (std_dev == 0)
+    {
+        return 1;
+    }
+
+    // Normalization factor based on the integral of the gaussian function.
+    double normal_factor = 1 / (sqrt((double)pow(std_dev, 2) * M_PI / 2.0) * (erf(radius / sqrt(2 * pow(std_dev, 2))) - erf(-radius / sqrt(2 * pow(std_dev, 2)))));
+    return normal_factor * pow(M_E, -pow(i, 2) / (2 * pow(std_dev, 2)));
+}
+
+/* Same weights as gaussian_kernel_fun, but with the normalization worked out once. exp(-i^2 / 2s^2) follows
+   from the previous tap by two multiplications, as consecutive exponents differ by (2i + 1) / 2s^2.*/
+static void create_gaussian_kernel(float *kernel, int radius)
+{
+    int std_dev = gaussian_std_dev(radius);
+    if (std_dev == 0)
+    {
+        kernel[0] = 1;
+        return;
+    }
+
+    double variance = (double)std_dev * std_dev;
+    double normal_factor = 1 / (sqrt(variance * M_PI / 2.0) * (erf(radius / sqrt(2 * variance)) - erf(-radius / sqrt(2 * variance))));
+    double weight = normal_factor;
+    double ratio = exp(-1 / (2 * variance));
+    double ratio_step = exp(-1 / variance);
+    for (int i = 0; i <= radius; i++)
+    {
+        kernel[radius - i] = weight;
+        kernel[radius + i] = weight;
+        weight *= ratio;
+        ratio *= ratio_step;
+    }
+}
+
+/* The viewer and batch jobs rebuild the same few kernels on every call, so the most recently used ones are kept
+   for the whole process.*/
+#define KERNEL_CACHE_SIZE 16
+
+typedef struct kernel_cache_entry
+{
+    float (*f)(int, int);
+    int radius;
+    float *weights; // NULL for an empty entry.
+    unsigned long last_used;
+} kernel_cache_entry;
+
+static kernel_cache_entry kernel_cache[KERNEL_CACHE_SIZE];
+static unsigned long kernel_cache_clock;
+static pthread_mutex_t kernel_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the entry for (f, radius), or NULL. Must be called with kernel_cache_mutex held.*/
+static kernel_cache_entry *kernel_cache_find(float (*f)(int, int), int radius)
+{
+    for (int i = 0; i < KERNEL_CACHE_SIZE; i++)
+    {
+        if (kernel_cache[i].weights != NULL && kernel_cache[i].f == f && kernel_cache[i].radius == radius)
+        {
+            kernel_cache[i].last_used = ++kernel_cache_clock;
+            return &kernel_cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Stores a copy of a kernel, replacing the least recently used entry.*/
+static void kernel_cache_insert(float (*f)(int, int), int radius, const float *kernel)
+{
+    int taps = 2 * radius + 1;
+    pthread_mutex_lock(&kernel_cache_mutex);
+    if (kernel_cache_find(f, radius) == NULL)
+    {
+        kernel_cache_entry *entry = &kernel_cache[0];
+        for (int i = 1; i < KERNEL_CACHE_SIZE; i++)
+        {
+            if (kernel_cache[i].last_used < entry->last_used)
+            {
+                entry = &kernel_cache[i];
+            }
+        }
+
+        float *weights = realloc(entry->weights, taps * sizeof(float));
+        if (weights != NULL)
+        {
+            memcpy(weights, kernel, taps * sizeof(float));
+            entry->f = f;
+            entry->radius = radius;
+            entry->weights = weights;
+            entry->last_used = ++kernel_cache_clock;
+        }
+    }
+
+    pthread_mutex_unlock(&kernel_cache_mutex);
+}
+
+void create_1d_filter_kernel(float **kernel, float (*f)(int, int), int radius)
+{
+    int taps = 2 * radius + 1;
+    pthread_mutex_lock(&kernel_cache_mutex);
+    kernel_cache_entry *entry = kernel_cache_find(f, radius);
+    if (entry != NULL)
+    {
+        memcpy(*kernel, entry->weights, taps * sizeof(float));
+    }
+
+    pthread_mutex_unlock(&kernel_cache_mutex);
+    if (entry != NULL)
+    {
+        return;
+    }
+
+    if (f == &gaussian_kernel_fun)
+    {
+        create_gaussian_kernel(*kernel, radius);
+    }
+    else
+    {
+        for (int i = -radius; i <= radius; i++)
+        {
+            (*kernel)[i + radius] = f(i, radius);
+        }
+    }
+
+    kernel_cache_insert(f, radius, *kernel);
+}
+
+/* Runs the separable FIR passes in place, fused when the bands are tall enough.*/
+static void run_fir(scratch_arena *arena, unsigned char *image, int width, int height, int channel_count, int kernel_radius, float *kernel, short *fixed_kernel, OverflowMode overflow_mode, const filter_options *options, const unsharp_params *unsharp)
+{
+    int threads = options->threads;
+    int bands = threads > 0 ? threads : thread_pool_available_threads();
+    if (height >= bands * 4 * kernel_radius)
+    {
+        // Halo rows cost at most half again the horizontal work, so stream through a ring buffer.
+        run_separable_fused(arena, image, image, width, height, kernel, fixed_kernel, options->intermediate_format, kernel_radius, channel_count, overflow_mode, threads, unsharp);
+    }
+    else
+    {
+        size_t sample_size = options->intermediate_format == INTERMEDIATE_UINT16 ? sizeof(unsigned short) : sizeof(unsigned char);
+        size_t mark = arena->used;
+        unsigned char *horizontally_filtered = scratch_arena_alloc(arena, (size_t)width * height * channel_count * sample_size);
+        run_separable(arena, image, horizontally_filtered, image, width, height, kernel, fixed_kernel, options->intermediate_format, kernel_radius, channel_count, overflow_mode, threads, unsharp);
+        scratch_arena_rewind(arena, mark);
+    }
+}
+
+/* Pyramid mode averages blocks of 2^levels x 2^levels pixels, blurs that small image with whatever the blocks
+   left of the Gaussian, and interpolates back to full size. A box of L samples adds a variance of
+   (L^2 - 1) / 12, and Catmull-Rom reproduces quadratics, so it adds none.
+   The box nulls every multiple of the coarse sampling rate, so a pattern just off one aliases to a low coarse
+   frequency d (in radians) with about d / 2pi of its amplitude A, and the coarse Gaussian leaves
+   A d exp(-sigma_c^2 d^2 / 2) / 2pi of it. That peaks at 0.0965 A / sigma_c, 12.3 / sigma_c 8-bit levels for a
+   pattern over the full range.*/
+#define PYRAMID_ALIASING_ERROR 12.3f
+#define PYRAMID_MAX_LEVELS 8
+
+typedef struct pyramid_job
+{
+    unsigned char *image;  // w*h pixels, read by the downsampling and written by the upsampling.
+    unsigned char *coarse; // coarse_w*coarse_h pixels.
+    int w;
+    int h;
+    int coarse_w;
+    int coarse_h;
+    int channel_count;
+    int levels;
+    OverflowMode overflow_mode;
+    int band_count;
+    unsigned int *sums;    // A full-width row of block sums per band.
+    float *rows;           // Four coarse rows interpolated to full width, per band.
+    int *cached_rows;      // The coarse row each of them holds, or -1.
+    int *column_taps;      // The four coarse pixels every output pixel of a row reads.
+    float *column_weights; // Their Catmull-Rom weights.
+} pyramid_job;
+
+/* Standard deviation, in coarse pixels, of the Gaussian that makes up sigma after averaging blocks of 2^levels.*/
+static float pyramid_coarse_sigma(float sigma, int levels)
+{
+    float factor = 1 << levels;
+    float variance = sigma * sigma - (factor * factor - 1) / 12;
+    return variance > 0 ? sqrtf(variance) / factor : 0;
+}
+
+int gaussian_pyramid_levels(float sigma, float error_budget)
+{
+    if (error_budget <= 0)
+    {
+        return 0;
+    }
+
+    int levels = 0;
+    while (levels < PYRAMID_MAX_LEVELS && pyramid_coarse_sigma(sigma, levels + 1) >= PYRAMID_ALIASING_ERROR / error_budget)
+    {
+        levels++;
+    }
+
+    return levels;
+}
+
+/* Keeps a few coarse pixels in each direction, so the interpolation has something to work with.*/
+static int pyramid_levels_for_size(int levels, int w, int h)
+{
+    levels = levels > PYRAMID_MAX_LEVELS ? PYRAMID_MAX_LEVELS : levels;
+    while (levels > 0 && ((w >> levels) < 4 || (h >> levels) < 4))
+    {
+        levels--;
+    }
+
+    return levels;
+}
+
+int filter_pyramid_levels(int width, int height, int kernel_radius, const filter_options *options)
+{
+    return pyramid_levels_for_size(gaussian_pyramid_levels(gaussian_std_dev(kernel_radius), options->pyramid_error_budget), width, height);
+}
+
+/* Every coarse row sums its block of full-resolution rows, then the blocks of that sum. Samples past the right and
+   bottom edges repeat the edge or count as zero, the same as the blur does outside the image.*/
+static void pyramid_band_downsample(void *arg, int band)
+{
+    pyramid_job *job = arg;
+    int factor = 1 << job->levels;
+    int channel_count = job->channel_count;
+    int width = job->w * channel_count;
+    unsigned int half = 1u << (2 * job->levels) >> 1;
+    int start_row = (int)((long)job->coarse_h * band / job->band_count);
+    int end_row = (int)((long)job->coarse_h * (band + 1) / job->band_count);
+
+    unsigned int *sums = job->sums + (size_t)band * width;
+    for (int y = start_row; y < end_row; y++)
+    {
+        memset(sums, 0, width * sizeof(unsigned int));
+        for (int i = 0; i < factor; i++)
+        {
+            int row = y * factor + i;
+            if (row >= job->h && job->overflow_mode == IGNORE)
+            {
+                break;
+            }
+
+            const unsigned char *pixels = job->image + (size_t)(row < job->h ? row : job->h - 1) * width;
+            for (int x = 0; x < width; x++)
+            {
+                sums[x] += pixels[x];
+            }
+        }
+
+        unsigned char *coarse_row = job->coarse + (size_t)y * job->coarse_w * channel_count;
+        for (int x = 0; x < job->coarse_w; x++)
+        {
+            for (int c = 0; c < channel_count; c++)
+            {
+                unsigned int sum = 0;
+                for (int i = 0; i < factor; i++)
+                {
+                    int column = x * factor + i;
+                    if (column >= job->w && job->overflow_mode == IGNORE)
+                    {
+                        break;
+                    }
+
+                    sum += sums[(column < job->w ? column : job->w - 1) * channel_count + c];
+                }
+
+                coarse_row[x * channel_count + c] = (sum + half) >> (2 * job->levels);
+            }
+        }
+    }
+}
+
+/* The four coarse pixels around full-resolution pixel `position` and their Catmull-Rom weights. Coarse pixel i
+   is centered on the middle of its block, i * 2^levels + (2^levels - 1) / 2. The blurred image is smooth past its
+   edge in both overflow modes, so taps outside it repeat the edge.*/
+static void pyramid_taps(int position, int levels, int coarse_count, int *taps, float *weights)
+{
+    int factor = 1 << levels;
+    float u = (position - (factor - 1) * 0.5f) / factor;
+    float base = floorf(u);
+    float t = u - base, t2 = t * t, t3 = t2 * t;
+    weights[0] = 0.5f * (-t3 + 2 * t2 - t);
+    weights[1] = 0.5f * (3 * t3 - 5 * t2 + 2);
+    weights[2] = 0.5f * (-3 * t3 + 4 * t2 + t);
+    weights[3] = 0.5f * (t3 - t2);
+    for (int i = 0; i < 4; i++)
+    {
+        int tap = (int)base - 1 + i;
+        taps[i] = tap < 0 ? 0 : (tap >= coarse_count ? coarse_count - 1 : tap);
+    }
+}
+
+/* Interpolates coarse row `coarse_row` to full width, into the cache slot it shares with no other row of a window.*/
+static float *pyramid_interpolated_row(pyramid_job *job, int band, int coarse_row)
+{
+    int channel_count = job->channel_count;
+    int width = job->w * channel_count;
+    int slot = coarse_row & 3;
+    float *row = job->rows + ((size_t)band * 4 + slot) * width;
+    int *cached = job->cached_rows + band * 4 + slot;
+    if (*cached == coarse_row)
+    {
+        return row;
+    }
+
+    const unsigned char *coarse = job->coarse + (size_t)coarse_row * job->coarse_w * channel_count;
+    for (int x = 0; x < job->w; x++)
+    {
+        const int *taps = job->column_taps + 4 * x;
+        const float *weights = job->column_weights + 4 * x;
+        for (int c = 0; c < channel_count; c++)
+        {
+            row[x * channel_count + c] = weights[0] * coarse[taps[0] * channel_count + c] + weights[1] * coarse[taps[1] * channel_count + c] +
+                                         weights[2] * coarse[taps[2] * channel_count + c] + weights[3] * coarse[taps[3] * channel_count + c];
+        }
+    }
+
+    *cached = coarse_row;
+    return row;
+}
+
+/* Consecutive output rows read the same four coarse rows with different weights, so every band interpolates each
+   coarse row it needs to full width once, and every output row blends four of those.*/
+static void pyramid_band_upsample(void *arg, int band)
+{
+    pyramid_job *job = arg;
+    int width = job->w * job->channel_count;
+    int start_row = (int)((long)job->h * band / job->band_count);
+    int end_row = (int)((long)job->h * (band + 1) / job->band_count);
+
+    for (int i = 0; i < 4; i++)
+    {
+        job->cached_rows[band * 4 + i] = -1;
+    }
+
+    for (int y = start_row; y < end_row; y++)
+    {
+        int taps[4];
+        float weights[4];
+        pyramid_taps(y, job->levels, job->coarse_h, taps, weights);
+        const float *row0 = pyramid_interpolated_row(job, band, taps[0]);
+        const float *row1 = pyramid_interpolated_row(job, band, taps[1]);
+        const float *row2 = pyramid_interpolated_row(job, band, taps[2]);
+        const float *row3 = pyramid_interpolated_row(job, band, taps[3]);
+        unsigned char *pixels = job->image + (size_t)y * width;
+        for (int x = 0; x < width; x++)
+        {
+            float result = weights[0] * row0[x] + weights[1] * row1[x] + weights[2] * row2[x] + weights[3] * row3[x] + 0.5f;
+            pixels[x] = result < 0 ? 0 : (result > 255 ? 255 : result);
+        }
+    }
+}
+
+/* Under REPEAT the blur reads the edge pixels past the edges, but the coarse blur reads the edge blocks. On detailed
+   input the two differ by up to the full range, and close to an edge, where half the kernel lies outside, that
+   puts the output tens of levels off. The edge pixels less their blocks are kept along each edge, in the order
+   left and right (h pixels each), then top and bottom (w pixels each).*/
+static void pyramid_edge_differences(const pyramid_job *job, float *differences)
+{
+    int channel_count = job->channel_count;
+    int last_column = job->w - 1, last_row = job->h - 1;
+    for (int edge = 0; edge < 4; edge++)
+    {
+        int vertical = edge < 2;
+        int count = vertical ? job->h : job->w;
+        float *line = differences + (size_t)(vertical ? edge * job->h : 2 * job->h + (edge - 2) * job->w) * channel_count;
+        for (int i = 0; i < count; i++)
+        {
+            int x = vertical ? (edge == 0 ? 0 : last_column) : i;
+            int y = vertical ? i : (edge == 2 ? 0 : last_row);
+            const unsigned char *pixel = job->image + ((size_t)y * job->w + x) * channel_count;
+            const unsigned char *block = job->coarse + ((size_t)(y >> job->levels) * job->coarse_w + (x >> job->levels)) * channel_count;
+            for (int c = 0; c < channel_count; c++)
+            {
+                line[i * channel_count + c] = (float)pixel[c] - block[c];
+            }
+        }
+    }
+}
+
+/* Adds the blur of those differences over the outside of each edge: the part of the kernel past the edge times the
+   differences blurred along it. The corner quadrants count for both of their edges, so their difference, the
+   corner pixel less the corner block, is taken off once.*/
+static void pyramid_correct_edges(scratch_arena *arena, const pyramid_job *job, float *differences, float sigma)
+{
+    int channel_count = job->channel_count;
+    int w = job->w, h = job->h;
+    int radius = ceilf(3 * sigma);
+    float *kernel = scratch_arena_alloc(arena, (2 * radius + 1) * sizeof(float));
+    double sum = 0;
+    for (int i = -radius; i <= radius; i++)
+    {
+        kernel[i + radius] = exp(-(double)i * i / (2.0 * sigma * sigma));
+        sum += kernel[i + radius];
+    }
+
+    for (int i = 0; i < 2 * radius + 1; i++)
+    {
+        kernel[i] /= sum;
+    }
+
+    // tails[d] is the part of the kernel that lies past the edge for a pixel d pixels inside it.
+    float *tails = scratch_arena_alloc(arena, (radius + 1) * sizeof(float));
+    tails[radius] = 0;
+    for (int d = radius - 1; d >= 0; d--)
+    {
+        tails[d] = tails[d + 1] + kernel[radius + d + 1];
+    }
+
+    // Blur every edge line along itself, repeating its ends.
+    size_t total = (size_t)2 * (w + h) * channel_count;
+    int longest = w > h ? w : h;
+    float *blurred = scratch_arena_alloc(arena, total * sizeof(float));
+    float *padded = scratch_arena_alloc(arena, (size_t)(longest + 2 * radius) * channel_count * sizeof(float));
+    for (int edge = 0; edge < 4; edge++)
+    {
+        int count = edge < 2 ? h : w;
+        size_t start = (size_t)(edge < 2 ? edge * h : 2 * h + (edge - 2) * w) * channel_count;
+        for (int i = -radius; i < count + radius; i++)
+        {
+            int j = i < 0 ? 0 : (i >= count ? count - 1 : i);
+            memcpy(padded + (size_t)(i + radius) * channel_count, differences + start + (size_t)j * channel_count, channel_count * sizeof(float));
+        }
+
+        convolve_float_row(blurred + start, padded, channel_count, kernel, 2 * radius + 1, count * channel_count);
+    }
+
+    const float *left = blurred, *right = blurred + (size_t)h * channel_count;
+    const float *top = blurred + (size_t)2 * h * channel_count, *bottom = top + (size_t)w * channel_count;
+    const float *left_differences = differences, *right_differences = differences + (size_t)h * channel_count;
+    int width = w * channel_count;
+    int side = (radius < w ? radius : w) * channel_count;
+    float *corrections = scratch_arena_alloc(arena, (size_t)width * sizeof(float));
+    float *samples = scratch_arena_alloc(arena, (size_t)width * sizeof(float));
+    float *edge_terms = scratch_arena_alloc(arena, 2 * channel_count * sizeof(float));
+    for (int y = 0; y < h; y++)
+    {
+        float top_tail = y < radius ? tails[y] : 0;
+        float bottom_tail = h - 1 - y < radius ? tails[h - 1 - y] : 0;
+        int near_row_edge = top_tail > 0 || bottom_tail > 0;
+
+        // Rows near the top or bottom are corrected across, the others only within radius of the sides.
+        for (int x = 0; x < width; x++)
+        {
+            if (!near_row_edge && x == side && width - side > side)
+            {
+                x = width - side;
+            }
+
+            corrections[x] = top_tail * top[x] + bottom_tail * bottom[x];
+        }
+
+        for (int c = 0; c < channel_count; c++)
+        {
+            edge_terms[c] = left[y * channel_count + c] - top_tail * left_differences[c] - bottom_tail * left_differences[(h - 1) * channel_count + c];
+            edge_terms[channel_count + c] = right[y * channel_count + c] - top_tail * right_differences[c] - bottom_tail * right_differences[(h - 1) * channel_count + c];
+        }
+
+        for (int x = 0; x < side; x++)
+        {
+            corrections[x] += tails[x / channel_count] * edge_terms[x % channel_count];
+            corrections[width - 1 - x] += tails[x / channel_count] * edge_terms[2 * channel_count - 1 - x % channel_count];
+        }
+
+        unsigned char *row = job->image + (size_t)y * width;
+        int spans[][2] = {{0, near_row_edge || 2 * side >= width ? width : side}, {near_row_edge || 2 * side >= width ? width : width - side, width}};
+        for (int i = 0; i < 2; i++)
+        {
+            int start = spans[i][0], count = spans[i][1] - spans[i][0];
+            widen_row(samples + start, row + start, count);
+            for (int x = start; x < start + count; x++)
+            {
+                samples[x] += corrections[x];
+            }
+
+            narrow_row(row + start, samples + start, 0.5f, count);
+        }
+    }
+}
+
+static void run_gaussian_pyramid(scratch_arena *arena, unsigned char *image, int w, int h, int channel_count, float sigma, int levels, OverflowMode overflow_mode, const filter_options *options)
+{
+    if (sigma <= 0)
+    {
+        return;
+    }
+
+    levels = pyramid_levels_for_size(levels, w, h);
+    if (levels <= 0)
+    {
+        // Too small to decimate, so blur at full resolution.
+        run_gaussian_iir(arena, image, w, h, channel_count, sigma, overflow_mode, options->threads);
+        return;
+    }
+
+    int threads = options->threads;
+    int factor = 1 << levels;
+    size_t mark = arena->used;
+    pyramid_job job = {image, NULL, w, h, (w + factor - 1) >> levels, (h + factor - 1) >> levels, channel_count, levels, overflow_mode};
+
+    job.coarse = scratch_arena_alloc(arena, (size_t)job.coarse_w * job.coarse_h * channel_count);
+    job.band_count = band_count_for(threads, job.coarse_h);
+    job.sums = scratch_arena_alloc(arena, (size_t)job.band_count * w * channel_count * sizeof(unsigned int));
+    thread_pool_run(threads, &pyramid_band_downsample, &job, job.band_count);
+
+    float *edge_differences = NULL;
+    if (overflow_mode == REPEAT)
+    {
+        edge_differences = scratch_arena_alloc(arena, (size_t)2 * (w + h) * channel_count * sizeof(float));
+        pyramid_edge_differences(&job, edge_differences);
+    }
+
+    float coarse_sigma = pyramid_coarse_sigma(sigma, levels);
+    int coarse_radius = ceilf(3 * coarse_sigma);
+    if (coarse_radius >= options->iir_crossover_radius)
+    {
+        run_gaussian_iir(arena, job.coarse, job.coarse_w, job.coarse_h, channel_count, coarse_sigma, overflow_mode, threads);
+    }
+    else if (coarse_radius > 0)
+    {
+        // sigma is fractional down here, so the kernel is normalized by its sum rather than by the integral.
+        int taps = 2 * coarse_radius + 1;
+        float *kernel = scratch_arena_alloc(arena, taps * sizeof(float));
+        double sum = 0;
+        for (int i = -coarse_radius; i <= coarse_radius; i++)
+        {
+            kernel[i + coarse_radius] = exp(-(double)i * i / (2.0 * coarse_sigma * coarse_sigma));
+            sum += kernel[i + coarse_radius];
+        }
+
+        for (int i = 0; i < taps; i++)
+        {
+            kernel[i] /= sum;
+        }
+
+        // Q0.15 rounds to nearest, so the coarse passes add no truncation bias to the downsampling's rounding.
+        short *fixed_kernel = scratch_arena_alloc(arena, taps * sizeof(short));
+        if (!create_1d_fixed_kernel(&fixed_kernel, &kernel, coarse_radius))
+        {
+            fixed_kernel = NULL;
+        }
+
+        run_fir(arena, job.coarse, job.coarse_w, job.coarse_h, channel_count, coarse_radius, kernel, fixed_kernel, overflow_mode, options, NULL);
+    }
+
+    job.band_count = band_count_for(threads, h);
+    job.rows = scratch_arena_alloc(arena, (size_t)job.band_count * 4 * w * channel_count * sizeof(float));
+    job.cached_rows = scratch_arena_alloc(arena, (size_t)job.band_count * 4 * sizeof(int));
+    job.column_taps = scratch_arena_alloc(arena, 4 * (size_t)w * sizeof(int));
+    job.column_weights = scratch_arena_alloc(arena, 4 * (size_t)w * sizeof(float));
+    for (int x = 0; x < w; x++)
+    {
+        pyramid_taps(x, levels, job.coarse_w, job.column_taps + 4 * x, job.column_weights + 4 * x);
+    }
+
+    thread_pool_run(threads, &pyramid_band_upsample, &job, job.band_count);
+    if (edge_differences != NULL)
+    {
+        pyramid_correct_edges(arena, &job, edge_differences, sigma);
+    }
+
+    scratch_arena_rewind(arena, mark);
+}
+
+void filter_image_gaussian_pyramid(unsigned char **image, int w, int h, int channel_count, float sigma, int levels, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    filter_options options = filter_default_options();
+    options.threads = threads;
+    run_gaussian_pyramid(&arena, *image, w, h, channel_count, sigma, levels, overflow_mode, &options);
+    scratch_arena_release(&arena);
+}
+
+/* Kernels that do not separate are filtered by convolving every channel with all (2r+1)^2 weights, with a sum of
+   separable terms, or with a product of spectra over tiles of the image. All read a copy of the image, so tiles
+   and bands can write their outputs in place.*/
+typedef struct kernel_2d_job
+{
+    unsigned char *image;        // Written by the tasks.
+    const unsigned char *source; // The image before filtering.
+    int w;
+    int h;
+    int channel_count;
+    const float *kernel; // (2 * kernel_radius + 1)^2 weights, row by row.
+    int kernel_radius;
+    OverflowMode overflow_mode;
+    int task_count;
+    float *scratch; // Per task.
+    int tile_w;     // FFT sizes of a tile, which gives (tile_w - 2r) x (tile_h - 2r) outputs.
+    int tile_h;
+    int tiles_x;
+    int tile_count;
+    fft_real_plan row_plan;
+    fft_plan column_plan;
+    const float *spectrum; // Spectrum of the kernel, laid out like a tile and scaled to undo the transforms.
+    const float *horizontal; // 2r+1 weights per separable term.
+    const float *vertical;
+    int term_count;
+} kernel_2d_job;
+
+/* Row y of the source, the edge row repeated outside the image, or NULL for rows that are ignored.*/
+static const unsigned char *kernel_2d_row(kernel_2d_job *job, int y)
+{
+    if (y < 0 || y >= job->h)
+    {
+        if (job->overflow_mode == IGNORE)
+        {
+            return NULL;
+        }
+
+        y = y < 0 ? 0 : job->h - 1;
+    }
+
+    return job->source + (size_t)y * job->w * job->channel_count;
+}
+
+static unsigned char round_float_sample(float result)
+{
+    result += 0.5f;
+    return result < 0 ? 0 : (result > 255 ? 255 : result);
+}
+
+/* Every source row a band reads is widened to float with r pixels of border on each side, so each weight of the
+   kernel row adds one contiguous span to the sums of the output row.*/
+static void direct_2d_band(void *arg, int band)
+{
+    kernel_2d_job *job = arg;
+    int channel_count = job->channel_count;
+    int kernel_radius = job->kernel_radius;
+    int taps = 2 * kernel_radius + 1;
+    int width = job->w * channel_count;
+    int start_row = (int)((long)job->h * band / job->task_count);
+    int end_row = (int)((long)job->h * (band + 1) / job->task_count);
+
+    float *sums = job->scratch + (size_t)band * (2 * width + 2 * kernel_radius * channel_count);
+    float *padded = sums + width;
+    for (int y = start_row; y < end_row; y++)
+    {
+        memset(sums, 0, width * sizeof(float));
+        for (int j = 0; j < taps; j++)
+        {
+            const unsigned char *row = kernel_2d_row(job, y + j - kernel_radius);
+            if (row == NULL)
+            {
+                continue;
+            }
+
+            for (int p = -kernel_radius; p < job->w + kernel_radius; p++)
+            {
+                for (int c = 0; c < channel_count; c++)
+                {
+                    padded[(p + kernel_radius) * channel_count + c] = box_edge_sample(row + c, p, job->w, channel_count, job->overflow_mode);
+                }
+            }
+
+            for (int i = 0; i < taps; i++)
+            {
+                float weight = job->kernel[j * taps + i];
+                if (weight != 0)
+                {
+                    multiply_add_row(sums, padded + i * channel_count, weight, width);
+                }
+            }
+        }
+
+        unsigned char *filtered_row = job->image + (size_t)y * width;
+        for (int x = 0; x < width; x++)
+        {
+            filtered_row[x] = round_float_sample(sums[x]);
+        }
+    }
+}
+
+static void run_direct_2d(scratch_arena *arena, unsigned char *image, int w, int h, int channel_count, const float *kernel, int kernel_radius, OverflowMode overflow_mode, int threads)
+{
+    size_t size = (size_t)w * h * channel_count;
+    size_t mark = arena->used;
+    kernel_2d_job job = {image, scratch_arena_alloc(arena, size), w, h, channel_count, kernel, kernel_radius, overflow_mode};
+
+    memcpy((unsigned char *)job.source, image, size);
+    job.task_count = band_count_for(threads, h);
+    job.scratch = scratch_arena_alloc(arena, (size_t)job.task_count * (2 * w + 2 * kernel_radius) * channel_count * sizeof(float));
+    thread_pool_run(threads, &direct_2d_band, &job, job.task_count);
+    scratch_arena_rewind(arena, mark);
+}
+
+void filter_image_direct_2d(unsigned char **image, int w, int h, int channel_count, const float *kernel, int kernel_radius, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    run_direct_2d(&arena, *image, w, h, channel_count, kernel, kernel_radius, overflow_mode, threads);
+    scratch_arena_release(&arena);
+}
+
+/* Tiles larger than this stop fitting in cache, whatever the transform counts say.*/
+#define FFT_MAX_TILE 512
+
+/* Work of filtering a tile of tile_w x tile_h samples: every row is transformed forward, the rows kept back, and
+   the tile_w / 2 + 1 columns of bins both ways. Unpacking the real transform costs about a pass.*/
+static double fft_tile_cost(int tile_w, int tile_h, int kernel_radius)
+{
+    double row = tile_w / 2 * (fft_cost(tile_w / 2) + 10);
+    return (2 * tile_h - 2 * kernel_radius) * row + 2.0 * (tile_w / 2 + 1) * tile_h * fft_cost(tile_h);
+}
+
+/* FFT sizes of the tiles that cover the image with the least work, which is returned per sample. Tiles are at
+   least 2r + 2 wide, and tile_w is even for the real transform.*/
+static double fft_tile_size(int w, int h, int kernel_radius, int *tile_w, int *tile_h)
+{
+    int smallest = fft_good_size(2 * kernel_radius + 2);
+    double best = INFINITY;
+    for (int tw = smallest; tw == smallest || tw <= FFT_MAX_TILE; tw = fft_good_size(tw + 1))
+    {
+        if (tw % 2 != 0)
+        {
+            continue;
+        }
+
+        for (int th = smallest; th == smallest || th <= FFT_MAX_TILE; th = fft_good_size(th + 1))
+        {
+            int tiles_x = (w + tw - 2 * kernel_radius - 1) / (tw - 2 * kernel_radius);
+            int tiles_y = (h + th - 2 * kernel_radius - 1) / (th - 2 * kernel_radius);
+            double cost = (double)tiles_x * tiles_y * fft_tile_cost(tw, th, kernel_radius);
+            if (cost < best)
+            {
+                best = cost;
+                *tile_w = tw;
+                *tile_h = th;
+            }
+
+            if (th - 2 * kernel_radius >= h)
+            {
+                break;
+            }
+        }
+
+        if (tw - 2 * kernel_radius >= w)
+        {
+            break;
+        }
+    }
+
+    return best / ((double)w * h);
+}
+
+/* Floats a tile of bins takes, which is also what its transforms need as work.*/
+static size_t fft_tile_floats(const kernel_2d_job *job)
+{
+    return (size_t)job->tile_h * (job->tile_w + 2);
+}
+
+/* Transforms the rows of a tile of tile_h x (tile_w + 2) floats, then its columns of bins all at once. With
+   `spectrum`, the bins are multiplied by it and the columns transformed back.*/
+static void fft_tile_forward(const kernel_2d_job *job, float *tile, float *work, const float *spectrum)
+{
+    int bins = job->tile_w / 2 + 1;
+    for (int y = 0; y < job->tile_h; y++)
+    {
+        fft_real_forward(&job->row_plan, tile + y * 2 * bins, work);
+    }
+
+    fft_forward_many(&job->column_plan, tile, work, bins);
+    if (spectrum == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < (size_t)job->tile_h * bins; i++)
+    {
+        float re = tile[2 * i], im = tile[2 * i + 1];
+        tile[2 * i] = re * spectrum[2 * i] - im * spectrum[2 * i + 1];
+        tile[2 * i + 1] = re * spectrum[2 * i + 1] + im * spectrum[2 * i];
+    }
+
+    fft_inverse_many(&job->column_plan, tile, work, bins);
+}
+
+/* Overlap-save: every tile reads its outputs and r samples around them, so the circular convolution wraps only
+   into samples that are thrown away. Only the rows kept are transformed back.*/
+static void fft_tiles(void *arg, int task)
+{
+    kernel_2d_job *job = arg;
+    int channel_count = job->channel_count;
+    int kernel_radius = job->kernel_radius;
+    int row_stride = job->tile_w + 2;
+    int step_x = job->tile_w - 2 * kernel_radius, step_y = job->tile_h - 2 * kernel_radius;
+
+    float *tile = job->scratch + task * 2 * fft_tile_floats(job);
+    float *work = tile + fft_tile_floats(job);
+    for (int index = task; index < job->tile_count; index += job->task_count)
+    {
+        int x0 = index % job->tiles_x * step_x, y0 = index / job->tiles_x * step_y;
+        int out_w = job->w - x0 < step_x ? job->w - x0 : step_x;
+        int out_h = job->h - y0 < step_y ? job->h - y0 : step_y;
+        for (int c = 0; c < channel_count; c++)
+        {
+            for (int y = 0; y < job->tile_h; y++)
+            {
+                const unsigned char *row = kernel_2d_row(job, y0 - kernel_radius + y);
+                float *samples = tile + y * row_stride;
+                for (int x = 0; x < job->tile_w; x++)
+                {
+                    samples[x] = row != NULL ? box_edge_sample(row + c, x0 - kernel_radius + x, job->w, channel_count, job->overflow_mode) : 0;
+                }
+            }
+
+            fft_tile_forward(job, tile, work, job->spectrum);
+            for (int y = 0; y < out_h; y++)
+            {
+                float *samples = tile + (y + kernel_radius) * row_stride;
+                fft_real_inverse(&job->row_plan, samples, work);
+                unsigned char *filtered = job->image + ((size_t)(y0 + y) * job->w + x0) * channel_count + c;
+                for (int x = 0; x < out_w; x++)
+                {
+                    filtered[x * channel_count] = round_float_sample(samples[x + kernel_radius]);
+                }
+            }
+        }
+    }
+}
+
+static void run_fft_2d(scratch_arena *arena, unsigned char *image, int w, int h, int channel_count, const float *kernel, int kernel_radius, OverflowMode overflow_mode, int threads)
+{
+    size_t size = (size_t)w * h * channel_count;
+    size_t mark = arena->used;
+    int taps = 2 * kernel_radius + 1;
+    kernel_2d_job job = {image, scratch_arena_alloc(arena, size), w, h, channel_count, kernel, kernel_radius, overflow_mode};
+
+    memcpy((unsigned char *)job.source, image, size);
+    fft_tile_size(w, h, kernel_radius, &job.tile_w, &job.tile_h);
+    job.tiles_x = (w + job.tile_w - 2 * kernel_radius - 1) / (job.tile_w - 2 * kernel_radius);
+    job.tile_count = job.tiles_x * ((h + job.tile_h - 2 * kernel_radius - 1) / (job.tile_h - 2 * kernel_radius));
+    job.task_count = threads > 0 ? threads : thread_pool_available_threads();
+    job.task_count = job.task_count < job.tile_count ? job.task_count : job.tile_count;
+    fft_real_plan_init(&job.row_plan, job.tile_w, arena);
+    fft_plan_init(&job.column_plan, job.tile_h, arena);
+    job.scratch = scratch_arena_alloc(arena, job.task_count * 2 * fft_tile_floats(&job) * sizeof(float));
+
+    // Correlating with the kernel is a circular convolution with it mirrored, so weight (i, j) goes to
+    // (-i, -j) modulo the tile. The scale undoes the tile_h of the column inverse and the tile_w / 2 of the rows.
+    int row_stride = job.tile_w + 2;
+    float *spectrum = scratch_arena_calloc(arena, fft_tile_floats(&job) * sizeof(float));
+    for (int j = -kernel_radius; j <= kernel_radius; j++)
+    {
+        for (int i = -kernel_radius; i <= kernel_radius; i++)
+        {
+            spectrum[(job.tile_h - j) % job.tile_h * row_stride + (job.tile_w - i) % job.tile_w] = kernel[(j + kernel_radius) * taps + i + kernel_radius];
+        }
+    }
+
+    fft_tile_forward(&job, spectrum, job.scratch, NULL);
+    float scale = 2.0f / ((float)job.tile_w * job.tile_h);
+    for (size_t i = 0; i < fft_tile_floats(&job); i++)
+    {
+        spectrum[i] *= scale;
+    }
+
+    job.spectrum = spectrum;
+    thread_pool_run(threads, &fft_tiles, &job, job.task_count);
+    scratch_arena_rewind(arena, mark);
+}
+
+void filter_image_fft(unsigned char **image, int w, int h, int channel_count, const float *kernel, int kernel_radius, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    run_fft_2d(&arena, *image, w, h, channel_count, kernel, kernel_radius, overflow_mode, threads);
+    scratch_arena_release(&arena);
+}
+
+/* Every band keeps the horizontally filtered rows of each term in a ring of 2r+1 float rows, and each output row
+   sums the vertical weights of every term over its window before rounding once. Terms may be negative, so
+   nothing is rounded or clamped in between.*/
+static void low_rank_band(void *arg, int band)
+{
+    kernel_2d_job *job = arg;
+    int channel_count = job->channel_count;
+    int kernel_radius = job->kernel_radius;
+    int taps = 2 * kernel_radius + 1;
+    int width = job->w * channel_count;
+    int start_row = (int)((long)job->h * band / job->task_count);
+    int end_row = (int)((long)job->h * (band + 1) / job->task_count);
+
+    float *sums = job->scratch + (size_t)band * ((size_t)(2 + job->term_count * taps) * width + 2 * kernel_radius * channel_count);
+    float *rows = sums + width;
+    float *padded = rows + (size_t)job->term_count * taps * width;
+    for (int y = start_row - kernel_radius; y < end_row + kernel_radius; y++)
+    {
+        // Row y goes into slot y mod 2r+1 of every term, over the row that left the window.
+        int slot = (y % taps + taps) % taps;
+        const unsigned char *row = kernel_2d_row(job, y);
+        if (row != NULL)
+        {
+            for (int p = -kernel_radius; p < job->w + kernel_radius; p++)
+            {
+                for (int c = 0; c < channel_count; c++)
+                {
+                    padded[(p + kernel_radius) * channel_count + c] = box_edge_sample(row + c, p, job->w, channel_count, job->overflow_mode);
+                }
+            }
+        }
+
+        for (int t = 0; t < job->term_count; t++)
+        {
+            float *filtered = rows + ((size_t)t * taps + slot) * width;
+            memset(filtered, 0, width * sizeof(float));
+            for (int i = 0; row != NULL && i < taps; i++)
+            {
+                multiply_add_row(filtered, padded + i * channel_count, job->horizontal[t * taps + i], width);
+            }
+        }
+
+        int output_row = y - kernel_radius;
+        if (output_row < start_row)
+        {
+            continue;
+        }
+
+        memset(sums, 0, width * sizeof(float));
+        for (int t = 0; t < job->term_count; t++)
+        {
+            for (int j = 0; j < taps; j++)
+            {
+                int window_slot = ((output_row + j - kernel_radius) % taps + taps) % taps;
+                multiply_add_row(sums, rows + ((size_t)t * taps + window_slot) * width, job->vertical[t * taps + j], width);
+            }
+        }
+
+        unsigned char *filtered_row = job->image + (size_t)output_row * width;
+        for (int x = 0; x < width; x++)
+        {
+            filtered_row[x] = round_float_sample(sums[x]);
+        }
+    }
+}
 
-    int end_overflowing = end_row > midpoint_row;
-    int curr_row_last_index = width * (midpoint_row + 1) - 1;
-    if (end_overflowing)
+static void run_low_rank(scratch_arena *arena, unsigned char *image, int w, int h, int channel_count, const float *horizontal, const float *vertical, int term_count, int kernel_radius, OverflowMode overflow_mode, int threads)
+{
+    size_t size = (size_t)w * h * channel_count;
+    size_t mark = arena->used;
+    int taps = 2 * kernel_radius + 1;
+    kernel_2d_job job = {image, scratch_arena_alloc(arena, size), w, h, channel_count, NULL, kernel_radius, overflow_mode};
+
+    memcpy((unsigned char *)job.source, image, size);
+    job.horizontal = horizontal;
+    job.vertical = vertical;
+    job.term_count = term_count;
+    // Every band also filters the r rows on each side of it, so bands are kept a few kernels tall.
+    job.task_count = band_count_for(threads, h / taps > 0 ? h / taps : 1);
+    job.scratch = scratch_arena_alloc(arena, (size_t)job.task_count * ((size_t)(2 + term_count * taps) * w + 2 * kernel_radius) * channel_count * sizeof(float));
+    thread_pool_run(threads, &low_rank_band, &job, job.task_count);
+    scratch_arena_rewind(arena, mark);
+}
+
+void filter_image_low_rank(unsigned char **image, int w, int h, int channel_count, const float *horizontal, const float *vertical, int term_count, int kernel_radius, OverflowMode overflow_mode, int threads)
+{
+    scratch_arena arena = {0};
+    run_low_rank(&arena, *image, w, h, channel_count, horizontal, vertical, term_count, kernel_radius, overflow_mode, threads);
+    scratch_arena_release(&arena);
+}
+
+/* One-sided Jacobi SVD: rotating pairs of columns of the kernel until all are orthogonal leaves U S in their
+   place, while the same rotations applied to the identity give V. Then kernel_2d = sum over k of
+   S_k U_k V_k^T, with U_k a column of weights over rows and V_k over columns.*/
+static int run_decompose_kernel_2d(scratch_arena *arena, const float *kernel_2d, int kernel_radius, float tolerance, float *horizontal, float *vertical)
+{
+    size_t mark = arena->used;
+    int taps = 2 * kernel_radius + 1;
+    double *a = scratch_arena_alloc(arena, (size_t)taps * taps * sizeof(double)); // Column k at a[k * taps].
+    double *v = scratch_arena_calloc(arena, (size_t)taps * taps * sizeof(double));
+    double norm = 0;
+    for (int k = 0; k < taps; k++)
+    {
+        v[k * taps + k] = 1;
+        for (int j = 0; j < taps; j++)
+        {
+            a[k * taps + j] = kernel_2d[j * taps + k];
+            norm += a[k * taps + j] * a[k * taps + j];
+        }
+    }
+
+    // Pairs are orthogonal enough when their product is negligible next to their norms, or next to the kernel for
+    // the columns that rank deficient kernels leave at rounding noise.
+    for (int sweep = 0, rotated = 1; rotated && sweep < 60; sweep++)
+    {
+        rotated = 0;
+        for (int p = 0; p < taps - 1; p++)
+        {
+            for (int q = p + 1; q < taps; q++)
+            {
+                double *ap = a + p * taps, *aq = a + q * taps;
+                double alpha = 0, beta = 0, gamma = 0;
+                for (int j = 0; j < taps; j++)
+                {
+                    alpha += ap[j] * ap[j];
+                    beta += aq[j] * aq[j];
+                    gamma += ap[j] * aq[j];
+                }
+
+                if (fabs(gamma) <= 1e-12 * sqrt(alpha * beta) || fabs(gamma) <= 1e-15 * norm)
+                {
+                    continue;
+                }
+
+                rotated = 1;
+                double zeta = (beta - alpha) / (2 * gamma);
+                double t = (zeta >= 0 ? 1 : -1) / (fabs(zeta) + sqrt(1 + zeta * zeta));
+                double c = 1 / sqrt(1 + t * t), s = c * t;
+                for (int j = 0; j < taps; j++)
+                {
+                    double x = ap[j], y = aq[j];
+                    ap[j] = c * x - s * y;
+                    aq[j] = s * x + c * y;
+                    x = v[p * taps + j];
+                    y = v[q * taps + j];
+                    v[p * taps + j] = c * x - s * y;
+                    v[q * taps + j] = s * x + c * y;
+                }
+            }
+        }
+    }
+
+    // Terms are taken by decreasing singular value until what is left of the kernel is small enough. An output
+    // moves by at most 255 times the sum of the absolute weights left out.
+    double *residual = scratch_arena_alloc(arena, (size_t)taps * taps * sizeof(double));
+    int *taken = scratch_arena_calloc(arena, taps * sizeof(int));
+    for (int i = 0; i < taps * taps; i++)
+    {
+        residual[i] = kernel_2d[i];
+    }
+
+    int term_count = 0;
+    for (; term_count < taps; term_count++)
+    {
+        double error = 0;
+        for (int i = 0; i < taps * taps; i++)
+        {
+            error += fabs(residual[i]);
+        }
+
+        if (255 * error <= tolerance)
+        {
+            break;
+        }
+
+        int largest = -1;
+        double largest_norm = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            double norm = 0;
+            for (int j = 0; j < taps; j++)
+            {
+                norm += a[k * taps + j] * a[k * taps + j];
+            }
+
+            if (!taken[k] && (largest < 0 || norm > largest_norm))
+            {
+                largest = k;
+                largest_norm = norm;
+            }
+        }
+
+        // Column k of U S has the singular value as its norm, and both sides get its square root.
+        taken[largest] = 1;
+        double root = sqrt(sqrt(largest_norm));
+        for (int j = 0; j < taps; j++)
+        {
+            vertical[term_count * taps + j] = root > 0 ? a[largest * taps + j] / root : 0;
+            horizontal[term_count * taps + j] = v[largest * taps + j] * root;
+        }
+
+        for (int j = 0; j < taps; j++)
+        {
+            for (int i = 0; i < taps; i++)
+            {
+                residual[j * taps + i] -= (double)vertical[term_count * taps + j] * horizontal[term_count * taps + i];
+            }
+        }
+    }
+
+    scratch_arena_rewind(arena, mark);
+    return term_count;
+}
+
+int decompose_kernel_2d(const float *kernel_2d, int kernel_radius, float tolerance, float *horizontal, float *vertical)
+{
+    scratch_arena arena = {0};
+    int term_count = run_decompose_kernel_2d(&arena, kernel_2d, kernel_radius, tolerance, horizontal, vertical);
+    scratch_arena_release(&arena);
+    return term_count;
+}
+
+/* Fills the 2r+1 weights of `kernel` and returns 1 when kernel_2d is the outer product of non-negative weights
+   with themselves, which the separable passes can take. The diagonal then holds their squares.*/
+static int separable_kernel(const float *kernel_2d, int kernel_radius, float *kernel)
+{
+    int taps = 2 * kernel_radius + 1;
+    float largest = 0;
+    for (int i = 0; i < taps * taps; i++)
+    {
+        largest = fabsf(kernel_2d[i]) > largest ? fabsf(kernel_2d[i]) : largest;
+    }
+
+    for (int i = 0; i < taps; i++)
+    {
+        kernel[i] = kernel_2d[i * taps + i] > 0 ? sqrtf(kernel_2d[i * taps + i]) : 0;
+    }
+
+    for (int j = 0; j < taps; j++)
+    {
+        for (int i = 0; i < taps; i++)
+        {
+            if (kernel_2d[j * taps + i] < 0 || fabsf(kernel_2d[j * taps + i] - kernel[j] * kernel[i]) > 1e-6f * largest)
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* Runs the backend filter() picks for the kernel on an image of interleaved channels. Scratch buffers come from
+   the arena and are given back before returning.*/
+static void filter_pixels(scratch_arena *arena, unsigned char *image, int width, int height, int channel_count, int kernel_radius, float (*filter_fun)(int i, int radius), float *kernel, short *fixed_kernel, OverflowMode overflow_mode, const filter_options *options)
+{
+    // Borders are handled while reading, and the vertical pass writes straight back into the image.
+    int threads = options->threads;
+    size_t size = (size_t)width * height * channel_count;
+    size_t mark = arena->used;
+    int pyramid_levels = 0;
+    if (filter_fun == &gaussian_kernel_fun && options->gaussian_mode == GAUSSIAN_PYRAMID)
+    {
+        // Images too small to decimate fall through to the exact backends.
+        pyramid_levels = filter_pyramid_levels(width, height, kernel_radius, options);
+    }
+
+    if (filter_fun == &box_kernel_fun)
+    {
+        // Every tap has the same weight, so running sums give the same result at O(1) per pixel.
+        unsigned char *horizontally_filtered = scratch_arena_alloc(arena, size);
+        run_box(arena, image, horizontally_filtered, image, width, height, kernel_radius, channel_count, overflow_mode, threads, 0.5f);
+    }
+    else if (filter_fun == &gaussian_kernel_fun && kernel_radius > 0 && options->gaussian_mode == GAUSSIAN_APPROX)
+    {
+        run_box_approx_gaussian(arena, image, width, height, channel_count, gaussian_std_dev(kernel_radius), options->gaussian_approx_passes, overflow_mode, threads);
+    }
+    else if (pyramid_levels > 0)
+    {
+        run_gaussian_pyramid(arena, image, width, height, channel_count, gaussian_std_dev(kernel_radius), pyramid_levels, overflow_mode, options);
+    }
+    else if (filter_fun == &gaussian_kernel_fun && kernel_radius > 0 && kernel_radius >= options->iir_crossover_radius)
+    {
+        // The recursive filter costs the same for every radius, so it wins once the FIR kernel gets long.
+        run_gaussian_iir(arena, image, width, height, channel_count, gaussian_std_dev(kernel_radius), overflow_mode, threads);
+    }
+    else
+    {
+        run_fir(arena, image, width, height, channel_count, kernel_radius, kernel, fixed_kernel, overflow_mode, options, NULL);
+    }
+
+    scratch_arena_rewind(arena, mark);
+}
+
+filter_options filter_default_options(void)
+{
+    filter_options options = {0, FILTER_DEFAULT_IIR_CROSSOVER_RADIUS, GAUSSIAN_EXACT, 3, ARITHMETIC_FLOAT, LAYOUT_INTERLEAVED, LAYOUT_INTERLEAVED, INTERMEDIATE_UINT8,
+                              FILTER_DEFAULT_PYRAMID_ERROR_BUDGET, FILTER_DEFAULT_FFT_CROSSOVER_RADIUS, FILTER_DEFAULT_LOW_RANK_TOLERANCE};
+    return options;
+}
+
+void filter_context_init(filter_context *context, const filter_options *options)
+{
+    context->options = options != NULL ? *options : filter_default_options();
+    memset(&context->arena, 0, sizeof(context->arena));
+}
+
+void filter_context_terminate(filter_context *context)
+{
+    scratch_arena_release(&context->arena);
+}
+
+/* Returns the pixels to filter in the layout filter_pixels takes, converting into the arena when the input is
+   interleaved but a planar layout is asked for. Sets *planar when the image is filtered plane by plane.*/
+static unsigned char *begin_layout(filter_context *context, unsigned char **image, int width, int height, int channel_count, int *planar)
+{
+    const filter_options *options = &context->options;
+    *planar = channel_count > 1 && (options->input_layout == LAYOUT_PLANAR || options->output_layout == LAYOUT_PLANAR);
+    if (!*planar || options->input_layout == LAYOUT_PLANAR)
+    {
+        return *image;
+    }
+
+    unsigned char *converted = scratch_arena_alloc(&context->arena, (size_t)width * height * channel_count);
+    deinterleave_image(&converted, image, width, height, channel_count, options->threads);
+    return converted;
+}
+
+/* Leaves the filtered pixels in the image in the output layout.*/
+static void end_layout(filter_context *context, unsigned char **image, unsigned char *pixels, int width, int height, int channel_count, int planar)
+{
+    const filter_options *options = &context->options;
+    size_t size = (size_t)width * height * channel_count;
+    if (planar && options->output_layout == LAYOUT_INTERLEAVED)
+    {
+        // Only reached with planar input, so `pixels` is the caller's buffer.
+        unsigned char *converted = scratch_arena_alloc(&context->arena, size);
+        interleave_image(&converted, &pixels, width, height, channel_count, options->threads);
+        memcpy(*image, converted, size);
+    }
+    else if (pixels != *image)
+    {
+        memcpy(*image, pixels, size);
+    }
+}
+
+static void print_time_since(struct timeval start)
+{
+    struct timeval end;
+    double cpu_time_used;
+    gettimeofday(&end, NULL);
+    cpu_time_used = (end.tv_sec - start.tv_sec) * 1000.0;    // sec to ms
+    cpu_time_used += (end.tv_usec - start.tv_usec) / 1000.0; // us to ms
+    printf("cpu_time_used: %f\n", cpu_time_used);
+}
+
+unsigned char **filter_with_context(filter_context *context, unsigned char **image, int width, int height, int channel_count, int kernel_radius, float (*filter_fun)(int i, int radius), OverflowMode overflow_mode)
+{
+    const filter_options *options = &context->options;
+    scratch_arena *arena = &context->arena;
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    float *kernel = scratch_arena_alloc(arena, (2 * kernel_radius + 1) * sizeof(float));
+    create_1d_filter_kernel(&kernel, filter_fun, kernel_radius);
+    short *fixed_kernel = NULL;
+    if (options->arithmetic == ARITHMETIC_FIXED_Q15)
     {
-        end = curr_row_last_index;
+        // Kernels that do not fit Q0.15 stay on the float path.
+        fixed_kernel = scratch_arena_alloc(arena, (2 * kernel_radius + 1) * sizeof(short));
+        if (!create_1d_fixed_kernel(&fixed_kernel, &kernel, kernel_radius))
+        {
+            fixed_kernel = NULL;
+        }
     }
 
-    int start_underflowing = start_row < midpoint_row;
-    int curr_row_first_index = width * midpoint_row;
-    int curr_channel = end % channel_count;
-    if (start_underflowing)
+    // Planar buffers are filtered one plane at a time, each as a single-channel image.
+    int planar;
+    unsigned char *pixels = begin_layout(context, image, width, height, channel_count, &planar);
+    for (int plane = 0; plane < (planar ? channel_count : 1); plane++)
     {
-        start = curr_row_first_index + curr_channel;
+        filter_pixels(arena, pixels + (size_t)plane * width * height, width, height, planar ? 1 : channel_count,
+                      kernel_radius, filter_fun, kernel, fixed_kernel, overflow_mode, options);
     }
 
-    float result = 0;
-    for (int i = start; i <= end; i += channel_count)
+    end_layout(context, image, pixels, width, height, channel_count, planar);
+
+    // Gives the memory back, sized for everything this call needed.
+    scratch_arena_reset(arena);
+    print_time_since(start);
+    return image;
+}
+
+/* Multiply-adds of the direct and low-rank loops that take as long as one flop of the FFT engine.*/
+#define FFT_MULTIPLY_ADDS_PER_FLOP 1.5
+
+/* Most separable terms that cost less than convolving a 2D kernel directly or, from the crossover radius, through
+   the FFT. The low-rank passes take 2 (2r+1) multiply-adds per term and sample.*/
+static int low_rank_max_terms(int width, int height, int kernel_radius, const filter_options *options)
+{
+    int taps = 2 * kernel_radius + 1;
+    double cost = taps * taps;
+    if (kernel_radius >= options->fft_crossover_radius)
     {
-        result += (*image)[i] * (*kernel)[(i - start) / channel_count];
+        int tile_w, tile_h;
+        cost = fft_tile_size(width, height, kernel_radius, &tile_w, &tile_h) * FFT_MULTIPLY_ADDS_PER_FLOP;
     }
 
-    return result;
+    return (int)ceil(cost / (2.0 * taps)) - 1;
+}
+
+/* Same as filter_pixels for a 2D kernel. Separable blur kernels take the separable passes and kernels split into
+   few enough terms the low-rank passes. The others are convolved directly or, from the crossover radius, through
+   the FFT.*/
+static void filter_pixels_2d(scratch_arena *arena, unsigned char *image, int width, int height, int channel_count, const float *kernel_2d, int kernel_radius, const float *kernel, const short *fixed_kernel,
+                             const float *horizontal, const float *vertical, int term_count, OverflowMode overflow_mode, const filter_options *options)
+{
+    if (kernel != NULL)
+    {
+        run_fir(arena, image, width, height, channel_count, kernel_radius, (float *)kernel, (short *)fixed_kernel, overflow_mode, options, NULL);
+    }
+    else if (term_count > 0)
+    {
+        run_low_rank(arena, image, width, height, channel_count, horizontal, vertical, term_count, kernel_radius, overflow_mode, options->threads);
+    }
+    else if (kernel_radius >= options->fft_crossover_radius)
+    {
+        run_fft_2d(arena, image, width, height, channel_count, kernel_2d, kernel_radius, overflow_mode, options->threads);
+    }
+    else
+    {
+        run_direct_2d(arena, image, width, height, channel_count, kernel_2d, kernel_radius, overflow_mode, options->threads);
+    }
 }
 
-/* Convolves a vertical filter kernel across an image region.*/
-unsigned char filter_region_one_channel_vertical(unsigned char **image, int width, int height, int start, int end, float **kernel, int kernel_radius)
+unsigned char **filter_2d_with_context(filter_context *context, unsigned char **image, int width, int height, int channel_count, const float *kernel_2d, int kernel_radius, OverflowMode overflow_mode)
 {
-    double start_row = floor((double)start / width);
-    double end_row = ceil((double)end / width);
+    const filter_options *options = &context->options;
+    scratch_arena *arena = &context->arena;
 
-    int start_col = start % width;
-    int end_col = end % width;
+    struct timeval start;
+    gettimeofday(&start, NULL);
 
-    int end_overflowing = end_row > height;
-    int curr_col_last_index = width * (height - 1) + start_col;
-    if (end_overflowing)
+    int taps = 2 * kernel_radius + 1;
+    float *kernel = scratch_arena_alloc(arena, taps * sizeof(float));
+    short *fixed_kernel = NULL;
+    float *horizontal = NULL, *vertical = NULL;
+    int term_count = 0;
+    if (!separable_kernel(kernel_2d, kernel_radius, kernel))
     {
-        end = curr_col_last_index;
+        // The SVD is only worth running when a term costs less than the 2D engines.
+        kernel = NULL;
+        int max_terms = low_rank_max_terms(width, height, kernel_radius, options);
+        if (options->low_rank_tolerance >= 0 && max_terms > 0)
+        {
+            horizontal = scratch_arena_alloc(arena, (size_t)taps * taps * sizeof(float));
+            vertical = scratch_arena_alloc(arena, (size_t)taps * taps * sizeof(float));
+            term_count = run_decompose_kernel_2d(arena, kernel_2d, kernel_radius, options->low_rank_tolerance, horizontal, vertical);
+            term_count = term_count <= max_terms ? term_count : 0;
+        }
     }
-
-    int start_underflowing = start_row < 0;
-    if (start_underflowing)
+    else if (options->arithmetic == ARITHMETIC_FIXED_Q15)
     {
-        start = end_col;
+        fixed_kernel = scratch_arena_alloc(arena, taps * sizeof(short));
+        if (!create_1d_fixed_kernel(&fixed_kernel, &kernel, kernel_radius))
+        {
+            fixed_kernel = NULL;
+        }
     }
 
-    float result = 0;
-    for (int i = start; i <= end; i += width)
+    int planar;
+    unsigned char *pixels = begin_layout(context, image, width, height, channel_count, &planar);
+    for (int plane = 0; plane < (planar ? channel_count : 1); plane++)
     {
-        result += (*image)[i] * (*kernel)[(i - start) / width];
+        filter_pixels_2d(arena, pixels + (size_t)plane * width * height, width, height, planar ? 1 : channel_count,
+                         kernel_2d, kernel_radius, kernel, fixed_kernel, horizontal, vertical, term_count, overflow_mode, options);
     }
 
-    return result;
+    end_layout(context, image, pixels, width, height, channel_count, planar);
+
+    scratch_arena_reset(arena);
+    print_time_since(start);
+    return image;
 }
 
-void filter_image_separable(unsigned char **filtered, unsigned char **horizontally_filtered, unsigned char **image, int w, int h, float **kernel, int kernel_radius, int channel_count)
+unsigned char **filter(unsigned char **image, int width, int height, int channel_count, int kernel_radius, float (*filter_fun)(int i, int radius), OverflowMode overflow_mode, const filter_options *options)
 {
-    int width = w * channel_count;
-    int height = h;
-    for (int y = 0; y < height; y++)
+    filter_context context;
+    filter_context_init(&context, options);
+    filter_with_context(&context, image, width, height, channel_count, kernel_radius, filter_fun, overflow_mode);
+    filter_context_terminate(&context);
+    return image;
+}
+
+unsigned char **filter_2d(unsigned char **image, int width, int height, int channel_count, const float *kernel_2d, int kernel_radius, OverflowMode overflow_mode, const filter_options *options)
+{
+    filter_context context;
+    filter_context_init(&context, options);
+    filter_2d_with_context(&context, image, width, height, channel_count, kernel_2d, kernel_radius, overflow_mode);
+    filter_context_terminate(&context);
+    return image;
+}
+
+unsigned char **unsharp_mask_with_context(filter_context *context, unsigned char **image, int width, int height, int channel_count, int kernel_radius, float amount, int threshold, OverflowMode overflow_mode)
+{
+    const filter_options *options = &context->options;
+    scratch_arena *arena = &context->arena;
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    float *kernel = scratch_arena_alloc(arena, (2 * kernel_radius + 1) * sizeof(float));
+    create_1d_filter_kernel(&kernel, &gaussian_kernel_fun, kernel_radius);
+    short *fixed_kernel = NULL;
+    if (options->arithmetic == ARITHMETIC_FIXED_Q15)
     {
-        for (int x = kernel_radius * channel_count; x < width - kernel_radius * channel_count; x++)
+        fixed_kernel = scratch_arena_alloc(arena, (2 * kernel_radius + 1) * sizeof(short));
+        if (!create_1d_fixed_kernel(&fixed_kernel, &kernel, kernel_radius))
         {
-            int i = x + y * width;
-            int start = i - kernel_radius * channel_count;
-            int end = i + kernel_radius * channel_count;
-            (*horizontally_filtered)[i] = filter_region_one_channel_horizontal(
-                image, width, start, end, kernel, kernel_radius, channel_count);
+            fixed_kernel = NULL;
         }
     }
 
-    for (int y = kernel_radius; y < height - kernel_radius; y++)
+    // Always the FIR passes, whatever the Gaussian mode, as the sharpening happens where they write a row.
+    unsharp_params unsharp = {amount, threshold};
+    int planar;
+    unsigned char *pixels = begin_layout(context, image, width, height, channel_count, &planar);
+    for (int plane = 0; plane < (planar ? channel_count : 1); plane++)
+    {
+        size_t mark = arena->used;
+        run_fir(arena, pixels + (size_t)plane * width * height, width, height, planar ? 1 : channel_count,
+                kernel_radius, kernel, fixed_kernel, overflow_mode, options, &unsharp);
+        scratch_arena_rewind(arena, mark);
+    }
+
+    end_layout(context, image, pixels, width, height, channel_count, planar);
+    scratch_arena_reset(arena);
+    print_time_since(start);
+    return image;
+}
+
+unsigned char **unsharp_mask(unsigned char **image, int width, int height, int channel_count, int kernel_radius, float amount, int threshold, OverflowMode overflow_mode, const filter_options *options)
+{
+    filter_context context;
+    filter_context_init(&context, options);
+    unsharp_mask_with_context(&context, image, width, height, channel_count, kernel_radius, amount, threshold, overflow_mode);
+    filter_context_terminate(&context);
+    return image;
+}
+
+/* Pipeline tiles are this many pixels on each side, plus the halo of the whole pipeline around them.*/
+#define PIPELINE_TILE 128
+
+typedef struct pipeline_rect
+{
+    int x0; // Image coordinates of [x0, x1) x [y0, y1).
+    int y0;
+    int x1;
+    int y1;
+} pipeline_rect;
+
+typedef struct pipeline_band
+{
+    unsigned char *above[2];   // Unfiltered rows above the current row of tiles, and the ones for the next.
+    unsigned char *below;      // Unfiltered rows below the band.
+    unsigned char *left;       // Unfiltered columns left of the current tile, for the rows of the tile.
+    unsigned char *buffers[2]; // Stage inputs and outputs over a tile and its halo.
+    float *horizontal;         // Horizontally filtered rows of a neighborhood stage.
+    float *padded;
+    float *sums;
+} pipeline_band;
+
+typedef struct pipeline_job
+{
+    const filter_pipeline *pipeline;
+    const float *kernels[PIPELINE_MAX_STAGES];
+    unsigned char *image;
+    int w;
+    int h;
+    int channel_count;
+    int first_channel; // Channel of the first sample of a pixel, for planes filtered one at a time.
+    OverflowMode overflow_mode;
+    int halo;
+    int band_count;
+    pipeline_band *bands;
+} pipeline_job;
+
+static void pipeline_band_rows(pipeline_job *job, int band, int *start, int *end)
+{
+    *start = (int)((long)job->h * band / job->band_count);
+    *end = (int)((long)job->h * (band + 1) / job->band_count);
+}
+
+/* `rect` grown by `reach` on every side and clipped to the image.*/
+static pipeline_rect pipeline_grow(pipeline_job *job, pipeline_rect rect, int reach)
+{
+    pipeline_rect grown = {rect.x0 - reach, rect.y0 - reach, rect.x1 + reach, rect.y1 + reach};
+    grown.x0 = grown.x0 > 0 ? grown.x0 : 0;
+    grown.y0 = grown.y0 > 0 ? grown.y0 : 0;
+    grown.x1 = grown.x1 < job->w ? grown.x1 : job->w;
+    grown.y1 = grown.y1 < job->h ? grown.y1 : job->h;
+    return grown;
+}
+
+/* Bands filter their tiles in place, so the halo rows a band reads from its neighbours are saved before any band
+   starts writing.*/
+static void pipeline_band_halos(void *arg, int band)
+{
+    pipeline_job *job = arg;
+    pipeline_band *state = &job->bands[band];
+    size_t width = (size_t)job->w * job->channel_count;
+    int start_row, end_row;
+    pipeline_band_rows(job, band, &start_row, &end_row);
+    for (int y = start_row - job->halo; y < end_row + job->halo; y++)
     {
-        for (int x = kernel_radius * channel_count; x < width - kernel_radius * channel_count; x++)
+        if (y >= 0 && y < start_row)
+        {
+            memcpy(state->above[0] + (y - start_row + job->halo) * width, job->image + y * width, width);
+        }
+        else if (y >= end_row && y < job->h)
         {
-            int i = x + y * width;
-            int start = i - kernel_radius * width;
-            int end = i + kernel_radius * width;
-            (*filtered)[i] = filter_region_one_channel_vertical(
-                horizontally_filtered, width, height, start, end, kernel, kernel_radius);
+            memcpy(state->below + (y - end_row) * width, job->image + y * width, width);
         }
     }
 }
 
-void pad_image(unsigned char **image, unsigned char **padded, int original_w, int original_h, int padding, int channel_count, OverflowMode overflow_mode)
+/* Filters the rows of `in` horizontally at the columns of `out`, then the columns of `out` vertically, and writes
+   the blur, or the sample sharpened away from it, to `target`. Buffers start at `frame` and hold rows of
+   `stride` bytes. Rows and columns outside the image are padded by the overflow mode, so both passes convolve
+   evenly spaced samples. Both passes truncate and saturate to bytes like filter()'s float passes with uint8
+   intermediate rows, and the sharpening works from that blur like unsharp_mask, so a stage gives the same bytes
+   as the separate call.*/
+static void pipeline_convolve(pipeline_job *job, pipeline_band *state, const pipeline_stage *stage, const float *kernel, pipeline_rect frame, int stride, pipeline_rect in, pipeline_rect out,
+                              const unsigned char *source, unsigned char *target)
 {
-    int padding_left = padding * channel_count / 2;
-    int padding_top = padding / 2;
-    int padded_width = (original_w + padding) * channel_count;
-    int padded_height = original_h + padding;
-    int padded_image_start = padded_width * padding_top + padding_left;
+    int channel_count = job->channel_count;
+    int kernel_radius = stage->kernel_radius;
+    int taps = 2 * kernel_radius + 1;
+    int width = (out.x1 - out.x0) * channel_count;
+    int padding = kernel_radius * channel_count;
+    float *padded = state->padded + padding;
+    for (int y = in.y0; y < in.y1; y++)
+    {
+        // Row y goes to row y - out.y0 + r of the horizontal buffer, whose first r rows may be above the image.
+        const unsigned char *row = source + (y - frame.y0) * stride + (out.x0 - frame.x0) * channel_count;
+        int first = -out.x0 * channel_count > -padding ? -out.x0 * channel_count : -padding;
+        int last = (job->w - out.x0) * channel_count < width + padding ? (job->w - out.x0) * channel_count : width + padding;
+        widen_row(padded + first, row + first, last - first);
 
-    for (int row = 0; row < original_h; row++)
+        for (int x = -padding; x < first; x++)
+        {
+            padded[x] = job->overflow_mode == IGNORE ? 0 : row[first + ((x - first) % channel_count + channel_count) % channel_count];
+        }
+
+        for (int x = last; x < width + padding; x++)
+        {
+            padded[x] = job->overflow_mode == IGNORE ? 0 : row[last - channel_count + (x - last) % channel_count];
+        }
+
+        float *horizontal = state->horizontal + (size_t)(y - out.y0 + kernel_radius) * width;
+        convolve_float_row(horizontal, state->padded, channel_count, kernel, taps, width);
+        for (int x = 0; x < width; x++)
+        {
+            horizontal[x] = saturate_sample(horizontal[x]);
+        }
+    }
+
+    for (int y = out.y0 - kernel_radius; y < out.y1 + kernel_radius; y++)
     {
-        unsigned char *image_row = *image + row * original_w * channel_count;
+        if (y >= 0 && y < job->h)
+        {
+            continue;
+        }
 
-        for (int i = 0; i < original_w * channel_count; i++)
+        float *row = state->horizontal + (size_t)(y - out.y0 + kernel_radius) * width;
+        int edge = y < 0 ? 0 : job->h - 1;
+        if (job->overflow_mode == IGNORE)
         {
-            (*padded)[padded_image_start + padded_width * row + i] = image_row[i];
+            memset(row, 0, width * sizeof(float));
         }
+        else
+        {
+            memcpy(row, state->horizontal + (size_t)(edge - out.y0 + kernel_radius) * width, width * sizeof(float));
+        }
+    }
 
-        if (overflow_mode == REPEAT)
+    for (int y = out.y0; y < out.y1; y++)
+    {
+        convolve_float_row(state->sums, state->horizontal + (size_t)(y - out.y0) * width, width, kernel, taps, width);
+        size_t offset = (size_t)(y - frame.y0) * stride + (out.x0 - frame.x0) * channel_count;
+        narrow_row(target + offset, state->sums, 0, width);
+        if (stage->operation == PIPELINE_UNSHARP)
         {
-            for (int i = 0; i < padding / 2; i++)
+            // The two truncating passes leave the blur a level low on average, as in unsharp_row.
+            sharpen_bytes_row(target + offset, source + offset, target + offset, stage->amount, stage->threshold, 1, width);
+        }
+    }
+}
+
+/* Gathers the tile and the halo of the whole pipeline, takes it through every stage over a region that shrinks by
+   each stage's radius, and writes the tile back. Before writing, the unfiltered columns and rows that the tiles to
+   the right and below still need are kept.*/
+static void pipeline_tile(pipeline_job *job, pipeline_band *state, pipeline_rect tile, int end_row, const unsigned char *above, unsigned char *next_above)
+{
+    int channel_count = job->channel_count;
+    int halo = job->halo;
+    size_t width = (size_t)job->w * channel_count;
+    pipeline_rect frame = pipeline_grow(job, tile, halo);
+    int stride = (PIPELINE_TILE + 2 * halo) * channel_count;
+    int span = (frame.x1 - frame.x0) * channel_count;
+    unsigned char *buffer = state->buffers[0];
+    for (int y = frame.y0; y < frame.y1; y++)
+    {
+        unsigned char *row = buffer + (y - frame.y0) * stride;
+        if (y < tile.y0)
+        {
+            memcpy(row, above + (y - tile.y0 + halo) * width + frame.x0 * channel_count, span);
+        }
+        else if (y >= end_row)
+        {
+            memcpy(row, state->below + (y - end_row) * width + frame.x0 * channel_count, span);
+        }
+        else if (y >= tile.y1)
+        {
+            memcpy(row, job->image + y * width + frame.x0 * channel_count, span);
+        }
+        else
+        {
+            int kept = (tile.x0 - frame.x0) * channel_count;
+            memcpy(row, state->left + (size_t)(y - tile.y0) * halo * channel_count + (halo * channel_count - kept), kept);
+            memcpy(row + kept, job->image + y * width + tile.x0 * channel_count, span - kept);
+        }
+    }
+
+    int left_start = tile.x1 - halo > frame.x0 ? tile.x1 - halo : frame.x0;
+    for (int y = tile.y0; y < tile.y1; y++)
+    {
+        int kept = (tile.x1 - left_start) * channel_count;
+        memcpy(state->left + (size_t)(y - tile.y0) * halo * channel_count + (halo * channel_count - kept), buffer + (y - frame.y0) * stride + (left_start - frame.x0) * channel_count, kept);
+    }
+
+    for (int y = tile.y1 - halo > frame.y0 ? tile.y1 - halo : frame.y0; y < tile.y1; y++)
+    {
+        memcpy(next_above + (y - tile.y1 + halo) * width + tile.x0 * channel_count, buffer + (y - frame.y0) * stride + (tile.x0 - frame.x0) * channel_count, (tile.x1 - tile.x0) * channel_count);
+    }
+
+    int reach = halo;
+    for (int i = 0; i < job->pipeline->stage_count; i++)
+    {
+        const pipeline_stage *stage = &job->pipeline->stages[i];
+        pipeline_rect in = pipeline_grow(job, tile, reach);
+        reach -= stage->kernel_radius;
+        pipeline_rect out = pipeline_grow(job, tile, reach);
+        if (stage->operation == PIPELINE_TONE_CURVE)
+        {
+            for (int y = out.y0; y < out.y1; y++)
             {
+                unsigned char *row = buffer + (y - frame.y0) * stride + (out.x0 - frame.x0) * channel_count;
                 for (int c = 0; c < channel_count; c++)
                 {
-                    int color_offset = i * channel_count + c;
-                    (*padded)[padded_image_start - padding_left + padded_width * row + color_offset] = image_row[c];
-                    (*padded)[padded_image_start - padding_left + padded_width * (row + 1) - padding_left + color_offset] = image_row[original_w * channel_count - channel_count + c];
+                    if (!(stage->channel_mask & 1 << (job->first_channel + c)))
+                    {
+                        continue;
+                    }
+
+                    for (int x = c; x < (out.x1 - out.x0) * channel_count; x += channel_count)
+                    {
+                        row[x] = stage->curve[row[x]];
+                    }
                 }
             }
 
-            if (row > 0 && row < original_h - 1)
-            {
-                continue; // Only repeat pixels horizontally on top and bottom.
-            }
+            continue;
+        }
 
-            for (int col = 0; col < padded_width; col++)
-            {
-                for (int i = 0; i < padding / 2; i++)
-                {
-                    (*padded)[col + padded_width * i] = (*padded)[padded_image_start - padding_left + col];
-                    (*padded)[padded_width * padded_height - col - padded_width * i] = (*padded)[padded_width * padded_height - padded_image_start - col];
-                }
-            }
+        unsigned char *target = buffer == state->buffers[0] ? state->buffers[1] : state->buffers[0];
+        pipeline_convolve(job, state, stage, job->kernels[i], frame, stride, in, out, buffer, target);
+        buffer = target;
+    }
+
+    for (int y = tile.y0; y < tile.y1; y++)
+    {
+        memcpy(job->image + y * width + tile.x0 * channel_count, buffer + (y - frame.y0) * stride + (tile.x0 - frame.x0) * channel_count, (tile.x1 - tile.x0) * channel_count);
+    }
+}
+
+static void pipeline_band_filter(void *arg, int band)
+{
+    pipeline_job *job = arg;
+    pipeline_band *state = &job->bands[band];
+    int start_row, end_row;
+    pipeline_band_rows(job, band, &start_row, &end_row);
+    for (int y = start_row, parity = 0; y < end_row; y += PIPELINE_TILE, parity = !parity)
+    {
+        for (int x = 0; x < job->w; x += PIPELINE_TILE)
+        {
+            pipeline_rect tile = {x, y, x + PIPELINE_TILE < job->w ? x + PIPELINE_TILE : job->w, y + PIPELINE_TILE < end_row ? y + PIPELINE_TILE : end_row};
+            pipeline_tile(job, state, tile, end_row, state->above[parity], state->above[!parity]);
         }
     }
 }
 
-void unpad_image(unsigned char **padded, unsigned char **image, int original_w, int original_h, int padding, int channel_count)
+static void run_pipeline(scratch_arena *arena, const filter_pipeline *pipeline, unsigned char *image, int w, int h, int channel_count, int first_channel, OverflowMode overflow_mode, int threads)
 {
-    for (unsigned char *image_ptr = *image; image_ptr < *image + original_w * channel_count * original_h; image_ptr += original_w * channel_count)
+    size_t mark = arena->used;
+    pipeline_job job = {pipeline};
+    job.image = image;
+    job.w = w;
+    job.h = h;
+    job.channel_count = channel_count;
+    job.first_channel = first_channel;
+    job.overflow_mode = overflow_mode;
+    job.halo = filter_pipeline_halo(pipeline);
+    for (int i = 0; i < pipeline->stage_count; i++)
     {
-        int row = (image_ptr - *image) / (original_w * channel_count);
-        int padded_width = (original_w + padding) * channel_count;
-        int padded_image_start = padded_width * padding / 2 + channel_count * padding / 2;
-        memcpy(
-            image_ptr,
-            *padded + padded_image_start + padded_width * row,
-            original_w * channel_count);
+        const pipeline_stage *stage = &pipeline->stages[i];
+        if (stage->operation != PIPELINE_TONE_CURVE)
+        {
+            float *kernel = scratch_arena_alloc(arena, (2 * stage->kernel_radius + 1) * sizeof(float));
+            create_1d_filter_kernel(&kernel, stage->filter_fun, stage->kernel_radius);
+            job.kernels[i] = kernel;
+        }
+    }
+
+    // One band per thread, as every band saves its halos and the tiles of a band run in order.
+    job.band_count = threads > 0 ? threads : thread_pool_available_threads();
+    job.band_count = job.band_count < h ? job.band_count : (h > 0 ? h : 1);
+    job.bands = scratch_arena_alloc(arena, job.band_count * sizeof(pipeline_band));
+    size_t rows_size = (size_t)job.halo * w * channel_count;
+    size_t side = PIPELINE_TILE + 2 * job.halo;
+    for (int band = 0; band < job.band_count; band++)
+    {
+        pipeline_band *state = &job.bands[band];
+        state->above[0] = scratch_arena_alloc(arena, rows_size);
+        state->above[1] = scratch_arena_alloc(arena, rows_size);
+        state->below = scratch_arena_alloc(arena, rows_size);
+        state->left = scratch_arena_alloc(arena, (size_t)PIPELINE_TILE * job.halo * channel_count);
+        state->buffers[0] = scratch_arena_alloc(arena, side * side * channel_count);
+        state->buffers[1] = scratch_arena_alloc(arena, side * side * channel_count);
+        state->horizontal = scratch_arena_alloc(arena, side * side * channel_count * sizeof(float));
+        state->padded = scratch_arena_alloc(arena, side * channel_count * sizeof(float));
+        state->sums = scratch_arena_alloc(arena, side * channel_count * sizeof(float));
     }
+
+    thread_pool_run(threads, &pipeline_band_halos, &job, job.band_count);
+    thread_pool_run(threads, &pipeline_band_filter, &job, job.band_count);
+    scratch_arena_rewind(arena, mark);
 }
 
-void create_1d_filter_kernel(float **kernel, float (*f)(int, int), int radius)
+void filter_pipeline_init(filter_pipeline *pipeline)
 {
-    for (int i = -radius; i <= radius; i++)
+    pipeline->stage_count = 0;
+}
+
+static pipeline_stage *pipeline_add(filter_pipeline *pipeline, PipelineOperation operation, int kernel_radius)
+{
+    if (pipeline->stage_count == PIPELINE_MAX_STAGES)
     {
-        (*kernel)[i + radius] = f(i, radius);
+        return NULL;
     }
+
+    pipeline_stage *stage = &pipeline->stages[pipeline->stage_count++];
+    memset(stage, 0, sizeof(*stage));
+    stage->operation = operation;
+    stage->kernel_radius = kernel_radius > 0 ? kernel_radius : 0;
+    return stage;
 }
 
-float box_kernel_fun(int i, int radius)
+int filter_pipeline_add_blur(filter_pipeline *pipeline, int kernel_radius, float (*filter_fun)(int i, int radius))
 {
-    return 1.0 / (2 * radius + 1);
+    pipeline_stage *stage = pipeline_add(pipeline, PIPELINE_BLUR, kernel_radius);
+    if (stage == NULL)
+    {
+        return 0;
+    }
+
+    stage->filter_fun = filter_fun;
+    return 1;
 }
 
-float gaussian_kernel_fun(int i, int radius)
+int filter_pipeline_add_unsharp(filter_pipeline *pipeline, int kernel_radius, float amount, int threshold)
 {
-    int std_dev = ceilf((float)radius / 3);
-    if (std_dev == 0)
+    pipeline_stage *stage = pipeline_add(pipeline, PIPELINE_UNSHARP, kernel_radius);
+    if (stage == NULL)
     {
-        return 1;
+        return 0;
     }
 
-    // Normalization factor based on the integral of the gaussian function.
-    double normal_factor = 1 / (sqrt((double)pow(std_dev, 2) * M_PI / 2.0) * (erf(radius / sqrt(2 * pow(std_dev, 2))) - erf(-radius / sqrt(2 * pow(std_dev, 2)))));
-    return normal_factor * pow(M_E, -pow(i, 2) / (2 * pow(std_dev, 2)));
+    stage->filter_fun = &gaussian_kernel_fun;
+    stage->amount = amount;
+    stage->threshold = threshold;
+    return 1;
 }
 
-unsigned char **filter(unsigned char **image, int width, int height, int channel_count, int kernel_radius, float (*filter_fun)(int i, int radius), OverflowMode overflow_mode)
+int filter_pipeline_add_tone_curve(filter_pipeline *pipeline, const unsigned char *curve, int channel_mask)
 {
-    int padding = kernel_radius * 2;
-    int padded_width = width + padding,
-        padded_height = height + padding;
+    pipeline_stage *stage = pipeline_add(pipeline, PIPELINE_TONE_CURVE, 0);
+    if (stage == NULL)
+    {
+        return 0;
+    }
 
-    struct timeval start, end;
-    double cpu_time_used;
-    gettimeofday(&start, NULL);
+    memcpy(stage->curve, curve, sizeof(stage->curve));
+    stage->channel_mask = channel_mask;
+    return 1;
+}
 
-    unsigned char *padded_image = malloc(padded_width * padded_height * channel_count * sizeof(unsigned char));
-    pad_image(image, &padded_image, width, height, padding, channel_count, overflow_mode);
+int filter_pipeline_halo(const filter_pipeline *pipeline)
+{
+    int halo = 0;
+    for (int i = 0; i < pipeline->stage_count; i++)
+    {
+        halo += pipeline->stages[i].kernel_radius;
+    }
 
-    float *kernel = malloc((2 * kernel_radius + 1) * sizeof(float));
-    create_1d_filter_kernel(&kernel, filter_fun, kernel_radius);
+    return halo;
+}
 
-    unsigned char *filtered = malloc(padded_width * padded_height * channel_count * sizeof(unsigned char));
-    unsigned char *horizontally_filtered = malloc(padded_width * padded_height * channel_count * sizeof(unsigned char));
-    filter_image_separable(&filtered, &horizontally_filtered, &padded_image, padded_width, padded_height, &kernel, kernel_radius, channel_count);
+unsigned char **filter_pipeline_run_with_context(filter_context *context, const filter_pipeline *pipeline, unsigned char **image, int width, int height, int channel_count, OverflowMode overflow_mode)
+{
+    const filter_options *options = &context->options;
+    struct timeval start;
+    gettimeofday(&start, NULL);
 
-    unpad_image(&filtered, image, width, height, padding, channel_count);
+    int planar;
+    unsigned char *pixels = begin_layout(context, image, width, height, channel_count, &planar);
+    for (int plane = 0; plane < (planar ? channel_count : 1); plane++)
+    {
+        run_pipeline(&context->arena, pipeline, pixels + (size_t)plane * width * height, width, height, planar ? 1 : channel_count, plane, overflow_mode, options->threads);
+    }
 
-    gettimeofday(&end, NULL);
-    cpu_time_used = (end.tv_sec - start.tv_sec) * 1000.0;    // sec to ms
-    cpu_time_used += (end.tv_usec - start.tv_usec) / 1000.0; // us to ms
-    printf("cpu_time_used: %f\n", cpu_time_used);
+    end_layout(context, image, pixels, width, height, channel_count, planar);
 
-    free(horizontally_filtered);
-    free(filtered);
-    free(kernel);
-    free(padded_image);
+    scratch_arena_reset(&context->arena);
+    print_time_since(start);
     return image;
 }
 
-#ifdef CL
-void filter_cl(cl_handle *handle, unsigned char **image, int width, int height, int channel_count, int kernel_radius, float (*filter_fun)(int i, int radius), OverflowMode overflow_mode)
+unsigned char **filter_pipeline_run(const filter_pipeline *pipeline, unsigned char **image, int width, int height, int channel_count, OverflowMode overflow_mode, const filter_options *options)
 {
-    int padding = kernel_radius * 2;
-    int padded_width = width + padding,
-        padded_height = height + padding;
+    filter_context context;
+    filter_context_init(&context, options);
+    filter_pipeline_run_with_context(&context, pipeline, image, width, height, channel_count, overflow_mode);
+    filter_context_terminate(&context);
+    return image;
+}
 
-    struct timeval start, end;
-    double gpu_time_used;
-    gettimeofday(&start, NULL);
+void report_gaussian_iir_accuracy(unsigned char **image, int width, int height, int channel_count, int kernel_radius, OverflowMode overflow_mode, const filter_options *options)
+{
+    filter_options fir_options = options != NULL ? *options : filter_default_options();
+    filter_options iir_options = fir_options;
+    fir_options.iir_crossover_radius = INT_MAX;
+    iir_options.iir_crossover_radius = 0;
 
-    size_t image_size = width * height * channel_count * sizeof(unsigned char);
-    cl_mem image_d = cl_alloc(image_size, handle, *image);
+    size_t size = (size_t)width * height * channel_count;
+    unsigned char *fir = malloc(size);
+    unsigned char *iir = malloc(size);
+    memcpy(fir, *image, size);
+    memcpy(iir, *image, size);
+    filter(&fir, width, height, channel_count, kernel_radius, &gaussian_kernel_fun, overflow_mode, &fir_options);
+    filter(&iir, width, height, channel_count, kernel_radius, &gaussian_kernel_fun, overflow_mode, &iir_options);
 
-    size_t padded_image_size = padded_width * padded_height * channel_count * sizeof(unsigned char);
-    cl_mem padded_image_d = cl_alloc(padded_image_size, handle, NULL);
+    int max_error = 0;
+    double squared_error = 0, absolute_error = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        int error = abs(fir[i] - iir[i]);
+        max_error = error > max_error ? error : max_error;
+        absolute_error += error;
+        squared_error += error * error;
+    }
 
-    cl_kernel pad_image_cl;
-    cl_execute_kernel(
-        handle,
-        &pad_image_cl,
-        "pad_image_cl",
-        7,
-        (void *[]){
-            &image_d, &padded_image_d, &width, &height, &padding, &channel_count, &overflow_mode},
-        (int[]){
-            sizeof(cl_mem), sizeof(cl_mem), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(OverflowMode)},
-        height);
+    double mse = size > 0 ? squared_error / size : 0;
+    printf("iir_accuracy (radius %i, sigma %.0f):\n", kernel_radius, gaussian_std_dev(kernel_radius));
+    printf("\tMax error: %i\n", max_error);
+    printf("\tMean error: %f\n", size > 0 ? absolute_error / size : 0);
+    printf("\tPSNR: %f dB\n", mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY);
 
-    size_t kernel_size = (2 * kernel_radius + 1) * sizeof(float);
-    float *kernel = malloc(kernel_size);
-    create_1d_filter_kernel(&kernel, filter_fun, kernel_radius);
-    cl_mem kernel_d = cl_alloc(kernel_size, handle, kernel);
+    free(iir);
+    free(fir);
+}
+
+#ifdef CL
+/* Work-group shape of a tiled pass: 64 samples wide, or fewer for long reaches, and up to 16 rows, as many as the
+   work-group size and half of the device's local memory allow, so that two groups can share a compute unit. A
+   tile takes halo_columns more samples on each row and halo_rows more rows. Returns 0 when none fits.*/
+static int cl_tile_size(cl_handle *handle, cl_kernel kernel, size_t halo_columns, size_t halo_rows, size_t *tile_w, size_t *tile_h)
+{
+    cl_ulong local_memory = 0;
+    size_t group_size = 0;
+    clGetDeviceInfo(handle->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_memory), &local_memory, NULL);
+    clGetKernelWorkGroupInfo(kernel, handle->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(group_size), &group_size, NULL);
+    for (*tile_w = 64; *tile_w >= 16; *tile_w /= 2)
+    {
+        for (*tile_h = 16; *tile_h >= 1; *tile_h /= 2)
+        {
+            if (*tile_w * *tile_h <= group_size && (*tile_w + halo_columns) * (*tile_h + halo_rows) <= local_memory / 2)
+            {
+                return 1;
+            }
+        }
+    }
 
-    size_t filtered_size = padded_width * padded_height * channel_count * sizeof(unsigned char);
-    cl_mem filtered_d = cl_alloc(filtered_size, handle, NULL);
-    cl_mem horizontally_filtered_d = cl_alloc(filtered_size, handle, NULL);
+    return 0;
+}
 
-    cl_kernel filter_image_horizontal_cl;
-    cl_execute_kernel(
+/* One pass of filter_cl over images, where the sampler reads past the edges, over a 2D NDRange of pixels.*/
+static void filter_image_pass_cl(cl_handle *handle, int vertical, cl_mem filtered_d, cl_mem image_d, int width, int height, cl_mem kernel_d, int kernel_radius, OverflowMode overflow_mode)
+{
+    cl_kernel kernel = cl_get_kernel(handle, "filter_image_pass_cl");
+    size_t group_w, group_h;
+    if (!cl_tile_size(handle, kernel, 0, 0, &group_w, &group_h))
+    {
+        // Work-groups smaller than 16 items; the runtime picks their shape.
+        group_w = group_h = 0;
+    }
+    cl_execute_kernel_2d(
         handle,
-        &filter_image_horizontal_cl,
-        "filter_image_horizontal_cl",
-        7,
+        &kernel,
+        NULL,
+        6,
         (void *[]){
-            &horizontally_filtered_d,
-            &padded_image_d,
-            &padded_width,
-            &padded_height,
-            &kernel_d,
-            &kernel_radius,
-            &channel_count},
+            &filtered_d, &image_d, &vertical, &kernel_d, &kernel_radius, &overflow_mode},
         (int[]){
-            sizeof(cl_mem), sizeof(cl_mem), sizeof(int), sizeof(int), sizeof(cl_mem), sizeof(int), sizeof(int)},
-        filtered_size);
+            sizeof(cl_mem), sizeof(cl_mem), sizeof(int), sizeof(cl_mem), sizeof(int), sizeof(OverflowMode)},
+        width, height, group_w, group_h);
+}
+
+/* One pass of filter_cl over buffers of samples, tiled through local memory, or reading every tap from global
+   memory when the kernel reach is too long for the device's local memory.*/
+static void filter_pass_cl(cl_handle *handle, int vertical, cl_mem filtered_d, cl_mem image_d, int w, int h, cl_mem kernel_d, int kernel_radius, int channel_count, OverflowMode overflow_mode)
+{
+    cl_kernel kernel = cl_get_kernel(handle, vertical ? "filter_image_vertical_tiled_cl" : "filter_image_horizontal_tiled_cl");
+    size_t halo_columns = vertical ? 0 : 2 * kernel_radius * channel_count;
+    size_t halo_rows = vertical ? 2 * kernel_radius : 0;
+    size_t tile_w, tile_h;
+    if (cl_tile_size(handle, kernel, halo_columns, halo_rows, &tile_w, &tile_h))
+    {
+        int tile_size = (tile_w + halo_columns) * (tile_h + halo_rows);
+        cl_execute_kernel_2d(
+            handle,
+            &kernel,
+            NULL,
+            9,
+            (void *[]){
+                &filtered_d, &image_d, &w, &h, &kernel_d, &kernel_radius, &channel_count, &overflow_mode, NULL},
+            (int[]){
+                sizeof(cl_mem), sizeof(cl_mem), sizeof(int), sizeof(int), sizeof(cl_mem), sizeof(int), sizeof(int), sizeof(OverflowMode), tile_size},
+            w * channel_count, h, tile_w, tile_h);
+        return;
+    }
 
-    cl_kernel filter_image_vertical_cl;
-    cl_execute_kernel(
+    kernel = cl_get_kernel(handle, vertical ? "filter_image_vertical_cl" : "filter_image_horizontal_cl");
+    cl_execute_kernel_2d(
         handle,
-        &filter_image_vertical_cl,
-        "filter_image_vertical_cl",
-        7,
+        &kernel,
+        NULL,
+        8,
         (void *[]){
-            &filtered_d,
-            &horizontally_filtered_d,
-            &padded_width,
-            &padded_height,
-            &kernel_d,
-            &kernel_radius,
-            &channel_count},
+            &filtered_d, &image_d, &w, &h, &kernel_d, &kernel_radius, &channel_count, &overflow_mode},
         (int[]){
-            sizeof(cl_mem), sizeof(cl_mem), sizeof(int), sizeof(int), sizeof(cl_mem), sizeof(int), sizeof(int)},
-        filtered_size);
+            sizeof(cl_mem), sizeof(cl_mem), sizeof(int), sizeof(int), sizeof(cl_mem), sizeof(int), sizeof(int), sizeof(OverflowMode)},
+        w * channel_count, h, 0, 0);
+}
+
+void filter_cl(cl_handle *handle, unsigned char **image, int width, int height, int channel_count, int kernel_radius, float (*filter_fun)(int i, int radius), OverflowMode overflow_mode)
+{
+    struct timeval start, end;
+    double gpu_time_used;
+    gettimeofday(&start, NULL);
+
+    size_t kernel_size = (2 * kernel_radius + 1) * sizeof(float);
+    float *kernel = malloc(kernel_size);
+    create_1d_filter_kernel(&kernel, filter_fun, kernel_radius);
+    cl_mem kernel_d = cl_buffer_acquire(handle, kernel_size, kernel);
+
+    // Images handle the edges in the sampler. Devices without them, and 3 channels, which have no 8-bit image
+    // format, take the buffer passes, which handle the edges while loading their samples.
+    cl_bool image_support = CL_FALSE;
+    clGetDeviceInfo(handle->device, CL_DEVICE_IMAGE_SUPPORT, sizeof(image_support), &image_support, NULL);
+    int use_images = image_support && channel_count != 3;
+
+    cl_mem image_d, horizontally_filtered_d, filtered_d;
+    size_t image_size = width * height * channel_count * sizeof(unsigned char);
+    if (use_images)
+    {
+        image_d = cl_image_acquire(handle, width, height, channel_count, *image);
+        horizontally_filtered_d = cl_image_acquire(handle, width, height, channel_count, NULL);
+        filtered_d = cl_image_acquire(handle, width, height, channel_count, NULL);
+        filter_image_pass_cl(handle, 0, horizontally_filtered_d, image_d, width, height, kernel_d, kernel_radius, overflow_mode);
+        filter_image_pass_cl(handle, 1, filtered_d, horizontally_filtered_d, width, height, kernel_d, kernel_radius, overflow_mode);
+    }
+    else
+    {
+        image_d = cl_buffer_acquire(handle, image_size, *image);
+        horizontally_filtered_d = cl_buffer_acquire(handle, image_size, NULL);
+        filtered_d = cl_buffer_acquire(handle, image_size, NULL);
+        filter_pass_cl(handle, 0, horizontally_filtered_d, image_d, width, height, kernel_d, kernel_radius, channel_count, overflow_mode);
+        filter_pass_cl(handle, 1, filtered_d, horizontally_filtered_d, width, height, kernel_d, kernel_radius, channel_count, overflow_mode);
+    }
 
     cl_event event;
-    unsigned char *filtered = malloc(filtered_size);
-    cl_int ret = clEnqueueReadBuffer(handle->command_queue, filtered_d, CL_TRUE, 0, filtered_size, filtered, 0, NULL, &event);
+    cl_int ret;
+    if (use_images)
+    {
+        size_t origin[] = {0, 0, 0};
+        size_t region[] = {width, height, 1};
+        ret = clEnqueueReadImage(handle->command_queue, filtered_d, CL_TRUE, origin, region, 0, 0, *image, 0, NULL, &event);
+    }
+    else
+    {
+        ret = clEnqueueReadBuffer(handle->command_queue, filtered_d, CL_TRUE, 0, image_size, *image, 0, NULL, &event);
+    }
+
     cl_handle_err(ret, 11);
     clWaitForEvents(1, &event);
-
-    unpad_image(&filtered, image, width, height, padding, channel_count);
+    clReleaseEvent(event);
 
     gettimeofday(&end, NULL);
     gpu_time_used = (end.tv_sec - start.tv_sec) * 1000.0;    // sec to ms
     gpu_time_used += (end.tv_usec - start.tv_usec) / 1000.0; // us to ms
     printf("gpu_time_used: %f\n", gpu_time_used);
 
-    free(filtered);
     free(kernel);
 
-    ret = clReleaseKernel(pad_image_cl);
-    ret = clReleaseMemObject(image_d);
-    ret = clReleaseMemObject(horizontally_filtered_d);
-    ret = clReleaseMemObject(filtered_d);
-    ret = clReleaseMemObject(kernel_d);
-    ret = clReleaseMemObject(padded_image_d);
+    // The kernels stay cached in the handle, and the buffers and images go back to its pool for the next call.
+    cl_buffer_release(handle, image_d);
+    cl_buffer_release(handle, horizontally_filtered_d);
+    cl_buffer_release(handle, filtered_d);
+    cl_buffer_release(handle, kernel_d);
 }
 
 #endif
\ No newline at end of file
@@ -1,156 +1,185 @@
 #include "filterimage_types.h"
 
-__kernel void pad_image_cl(__global unsigned char *image,
-                           __global unsigned char *padded, int original_w,
-                           int original_h, int padding, int channel_count,
-                           OverflowMode overflow_mode) {
-  int padding_left = padding * channel_count / 2;
-  int padding_top = padding / 2;
-  int padded_width = (original_w + padding) * channel_count;
-  int padded_height = original_h + padding;
-  int padded_image_start = padded_width * padding_top + padding_left;
-
-  int thread_id = get_global_id(0);
-  int row = thread_id;
-  if (row > original_h)
+// Edges of the image passes: REPEAT reads the edge pixel, IGNORE reads 0.
+__constant sampler_t repeat_sampler = CLK_NORMALIZED_COORDS_FALSE |
+                                      CLK_ADDRESS_CLAMP_TO_EDGE |
+                                      CLK_FILTER_NEAREST;
+__constant sampler_t ignore_sampler =
+    CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_NEAREST;
+
+float4 convolve_image(read_only image2d_t image, sampler_t sampler,
+                      int2 position, int2 step,
+                      __constant float *filter_kernel, int kernel_radius) {
+  float4 result = 0;
+  for (int k = -kernel_radius; k <= kernel_radius; k++) {
+    result += convert_float4(read_imageui(image, sampler, position + k * step)) *
+              filter_kernel[k + kernel_radius];
+  }
+
+  return result;
+}
+
+// One pass of the separable filter over a 2D NDRange of pixels, horizontal or
+// vertical. The sampler handles the edges, so the image needs no padding.
+__kernel void filter_image_pass_cl(write_only image2d_t filtered,
+                                   read_only image2d_t image, int vertical,
+                                   __constant float *filter_kernel,
+                                   int kernel_radius,
+                                   OverflowMode overflow_mode) {
+  int2 position = (int2)(get_global_id(0), get_global_id(1));
+  if (position.x >= get_image_width(image) ||
+      position.y >= get_image_height(image))
     return;
 
-  __global unsigned char *image_row = image + row * original_w * channel_count;
+  int2 step = vertical ? (int2)(0, 1) : (int2)(1, 0);
+  float4 result =
+      overflow_mode == REPEAT
+          ? convolve_image(image, repeat_sampler, position, step,
+                           filter_kernel, kernel_radius)
+          : convolve_image(image, ignore_sampler, position, step,
+                           filter_kernel, kernel_radius);
+  write_imageui(filtered, position, convert_uint4_sat(result));
+}
 
-  for (int i = 0; i < original_w * channel_count; i++) {
-    padded[padded_image_start + padded_width * row + i] = image_row[i];
+// Sample `column` of a row of w pixels, where columns past the edges read the
+// edge pixel under REPEAT and 0 under IGNORE.
+unsigned char row_sample(__global const unsigned char *row, int column, int w,
+                         int channel_count, OverflowMode overflow_mode) {
+  int pixel = column < 0 ? -1 - (-1 - column) / channel_count
+                         : column / channel_count;
+  int channel = column - pixel * channel_count;
+  if (pixel < 0 || pixel >= w) {
+    if (overflow_mode == IGNORE)
+      return 0;
+
+    pixel = clamp(pixel, 0, w - 1);
   }
 
-  if (overflow_mode == REPEAT) {
-    for (int i = 0; i < padding / 2; i++) {
-      for (int c = 0; c < channel_count; c++) {
-        int color_offset = i * channel_count + c;
-        padded[padded_image_start - padding_left + padded_width * row +
-               color_offset] = image_row[c];
-        padded[padded_image_start - padding_left + padded_width * (row + 1) -
-               padding_left + color_offset] =
-            image_row[original_w * channel_count - channel_count + c];
-      }
-    }
-
-    if (row > 0 && row < original_h - 1) {
-      return; // Only repeat pixels horizontally on top and bottom.
-    }
-
-    for (int col = 0; col < padded_width; col++) {
-      for (int i = 0; i < padding / 2; i++) {
-        padded[col + padded_width * i] =
-            padded[padded_image_start - padding_left + col];
-        padded[padded_width * padded_height - col - padded_width * i] =
-            padded[padded_width * padded_height - padded_image_start - col];
-      }
-    }
-  }
+  return row[pixel * channel_count + channel];
 }
 
-unsigned char filter_region_one_channel_horizontal(
-    __global unsigned char *image, int width, int start, int end,
-    __global float *filter_kernel, int kernel_radius, int channel_count) {
-  int midpoint = (start + end) / 2;
-  float start_row = (float)floor((float)start / width);
-  float midpoint_row = (float)floor((float)midpoint / width);
-  float end_row = (float)floor((float)end / width);
-
-  int end_overflowing = end_row > midpoint_row;
-  int curr_row_last_index = width * (midpoint_row + 1) - 1;
-  if (end_overflowing) {
-    end = curr_row_last_index;
+// Tiled passes over a 2D NDRange of samples by rows, for devices without
+// images. A work-group first copies the samples its outputs need, its tile
+// plus the kernel reach on either side, into local memory, with neighbouring
+// items reading neighbouring bytes. The taps then read local memory only.
+// Items past the image still load their share, so every item reaches the
+// barrier.
+__kernel void filter_image_horizontal_tiled_cl(
+    __global unsigned char *filtered, __global const unsigned char *image,
+    int w, int h, __constant float *filter_kernel, int kernel_radius,
+    int channel_count, OverflowMode overflow_mode,
+    __local unsigned char *tile) {
+  const int width = w * channel_count;
+  const int reach = kernel_radius * channel_count;
+  const int tile_w = get_local_size(0);
+  const int local_x = get_local_id(0);
+  const int local_y = get_local_id(1);
+  const int x = get_global_id(0);
+  const int y = min((int)get_global_id(1), h - 1);
+  const int tile_start = get_group_id(0) * tile_w - reach;
+  const int tile_row = tile_w + 2 * reach;
+
+  __local unsigned char *tile_samples = tile + local_y * tile_row;
+  for (int i = local_x; i < tile_row; i += tile_w) {
+    tile_samples[i] = row_sample(image + y * width, tile_start + i, w,
+                                 channel_count, overflow_mode);
   }
 
-  int start_underflowing = start_row < midpoint_row;
-  int curr_row_first_index = width * midpoint_row;
-  int curr_channel = end % channel_count;
-  if (start_underflowing) {
-    start = curr_row_first_index + curr_channel;
-  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (get_global_id(1) >= h || x >= width)
+    return;
 
   float result = 0;
-  int ki = 0;
-  for (int i = start; i <= end; i += channel_count) {
-    result += image[i] * filter_kernel[ki++];
+  for (int k = 0; k <= 2 * kernel_radius; k++) {
+    result += tile_samples[local_x + k * channel_count] * filter_kernel[k];
   }
 
-  return result;
+  filtered[y * width + x] = convert_uchar_sat(result);
 }
 
-unsigned char filter_region_one_channel_vertical(__global unsigned char *image,
-                                                 int width, int height,
-                                                 int start, int end,
-                                                 __global float *filter_kernel,
-                                                 int kernel_radius) {
-  float start_row = (float)floor((float)start / width);
-  float end_row = (float)ceil((float)end / width);
-
-  int start_col = start % width;
-  int end_col = end % width;
-
-  int end_overflowing = end_row > height;
-  int curr_col_last_index = width * (height - 1) + start_col;
-  if (end_overflowing) {
-    end = curr_col_last_index;
+__kernel void filter_image_vertical_tiled_cl(
+    __global unsigned char *filtered, __global const unsigned char *image,
+    int w, int h, __constant float *filter_kernel, int kernel_radius,
+    int channel_count, OverflowMode overflow_mode,
+    __local unsigned char *tile) {
+  const int width = w * channel_count;
+  const int tile_w = get_local_size(0);
+  const int tile_h = get_local_size(1);
+  const int local_x = get_local_id(0);
+  const int local_y = get_local_id(1);
+  const int x = min((int)get_global_id(0), width - 1);
+  const int y = get_global_id(1);
+  const int tile_start = get_group_id(1) * tile_h - kernel_radius;
+  const int tile_rows = tile_h + 2 * kernel_radius;
+
+  for (int i = local_y; i < tile_rows; i += tile_h) {
+    int row = tile_start + i;
+    int outside = row < 0 || row >= h;
+    tile[i * tile_w + local_x] =
+        outside && overflow_mode == IGNORE
+            ? 0
+            : image[clamp(row, 0, h - 1) * width + x];
   }
 
-  int start_underflowing = start_row < 0;
-  if (start_underflowing) {
-    start = end_col;
-  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (get_global_id(0) >= width || y >= h)
+    return;
 
   float result = 0;
-  int ki = 0;
-  for (int i = start; i <= end; i += width) {
-    result += image[i] * filter_kernel[ki++];
+  for (int k = 0; k <= 2 * kernel_radius; k++) {
+    result += tile[(local_y + k) * tile_w + local_x] * filter_kernel[k];
   }
 
-  return result;
+  filtered[y * width + x] = convert_uchar_sat(result);
 }
 
+// Untiled passes for kernel reaches whose tiles do not fit in local memory.
+// Every tap reads global memory.
 __kernel void filter_image_horizontal_cl(__global unsigned char *filtered,
-                                         __global unsigned char *image, int w,
-                                         int h, __global float *filter_kernel,
-                                         int kernel_radius, int channel_count) {
+                                         __global const unsigned char *image,
+                                         int w, int h,
+                                         __constant float *filter_kernel,
+                                         int kernel_radius, int channel_count,
+                                         OverflowMode overflow_mode) {
   const int width = w * channel_count;
-  const int height = h;
-  int tid = get_global_id(0);
-
-  int x = tid % width;
-
-  int start;
-  int end;
-  if (x >= kernel_radius * channel_count &&
-      x < width - kernel_radius * channel_count) {
-    start = tid - kernel_radius * channel_count;
-    end = tid + kernel_radius * channel_count;
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  if (x >= width || y >= h)
+    return;
 
-    filtered[tid] = filter_region_one_channel_horizontal(
-        image, width, start, end, filter_kernel, kernel_radius, channel_count);
+  float result = 0;
+  for (int k = -kernel_radius; k <= kernel_radius; k++) {
+    result += row_sample(image + y * width, x + k * channel_count, w,
+                         channel_count, overflow_mode) *
+              filter_kernel[k + kernel_radius];
   }
+
+  filtered[y * width + x] = convert_uchar_sat(result);
 }
 
 __kernel void filter_image_vertical_cl(__global unsigned char *filtered,
-                                       __global unsigned char *image, int w,
-                                       int h, __global float *filter_kernel,
-                                       int kernel_radius, int channel_count) {
+                                       __global const unsigned char *image,
+                                       int w, int h,
+                                       __constant float *filter_kernel,
+                                       int kernel_radius, int channel_count,
+                                       OverflowMode overflow_mode) {
   const int width = w * channel_count;
-  const int height = h;
-  int tid = get_global_id(0);
-
-  int x = tid % width;
-  int y = tid / width;
-
-  int start;
-  int end;
-  if (y >= kernel_radius - 1 && y <= height - kernel_radius &&
-      x >= kernel_radius * channel_count &&
-      x < width - kernel_radius * channel_count) {
-    start = tid - kernel_radius * width;
-    end = tid + kernel_radius * width;
-
-    filtered[tid] = filter_region_one_channel_vertical(
-        image, width, height, start, end, filter_kernel, kernel_radius);
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  if (x >= width || y >= h)
+    return;
+
+  float result = 0;
+  for (int k = -kernel_radius; k <= kernel_radius; k++) {
+    int row = y + k;
+    if ((row < 0 || row >= h) && overflow_mode == IGNORE)
+      continue;
+
+    result += image[clamp(row, 0, h - 1) * width + x] *
+              filter_kernel[k + kernel_radius];
   }
+
+  filtered[y * width + x] = convert_uchar_sat(result);
 }
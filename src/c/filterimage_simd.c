@@ -0,0 +1,1065 @@
+#include <stddef.h>
+#include <math.h>
+#include <string.h>
+#include "filterimage_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Radii 1 to SPECIALIZED_MAX_RADIUS get variants with the tap count compiled in, so their tap loops unroll
+   completely. Generic instances are unrolled by the same factor.*/
+#define SPECIALIZED_MAX_RADIUS 8
+#define UNROLL_TAPS _Pragma("GCC unroll 17")
+
+/*
+ * Both kernels widen their samples to float and accumulate with a separate
+ * multiply and add in tap order, so every output is bit-identical to the
+ * scalar float path. uint8 results are truncated and saturate to [0, 255]
+ * when packed, SAMPLE_UINT16_8_7 results round to nearest and saturate to
+ * [0, 32767].
+ */
+
+/* Bytes per sample of a format.*/
+static inline int sample_size(SampleFormat format)
+{
+    return format == SAMPLE_UINT8 ? 1 : 2;
+}
+
+__attribute__((target("avx2"))) static inline __m256 load_widened_avx2(const unsigned char *src, SampleFormat format)
+{
+    if (format == SAMPLE_UINT8)
+    {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)src)));
+    }
+
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)src)));
+}
+
+/* Stores 16 rounded SAMPLE_UINT16_8_7 results. packs_epi32 works per 128-bit lane, so the 8-byte groups come out
+   as 0 2 1 3.*/
+__attribute__((target("avx2"), always_inline)) static inline void store_wide_avx2(unsigned char *filtered, __m256 first, __m256 second)
+{
+    __m256i words = _mm256_packs_epi32(_mm256_cvtps_epi32(first), _mm256_cvtps_epi32(second));
+    words = _mm256_max_epi16(_mm256_permute4x64_epi64(words, 0xD8), _mm256_setzero_si256());
+    _mm256_storeu_si256((__m256i *)filtered, words);
+}
+
+/* Tap k of output x reads rows[k][x], or base[x + k * step] when rows is NULL. Inlined into every
+   entry point so the address arithmetic and sample formats are specialized for each.*/
+__attribute__((target("avx2"), always_inline)) static inline int filter_taps_avx2(unsigned char *filtered, const unsigned char *const *rows, const unsigned char *base, int step, int start, int end, const float *kernel, int taps, SampleFormat source, SampleFormat result)
+{
+    // 32 outputs in flight, 8 per accumulator.
+    const __m256i interleave = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int size = sample_size(source);
+    int x = start;
+    for (; x + 32 <= end; x += 32)
+    {
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(),
+               acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+        UNROLL_TAPS
+        for (int k = 0; k < taps; k++)
+        {
+            const unsigned char *tap = rows != NULL ? rows[k] + x * size : base + (x + k * step) * size;
+            __m256 weight = _mm256_set1_ps(kernel[k]);
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(load_widened_avx2(tap, source), weight));
+            acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(load_widened_avx2(tap + 8 * size, source), weight));
+            acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(load_widened_avx2(tap + 16 * size, source), weight));
+            acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(load_widened_avx2(tap + 24 * size, source), weight));
+        }
+
+        if (result == SAMPLE_UINT16_8_7)
+        {
+            store_wide_avx2(filtered + x * 2, acc0, acc1);
+            store_wide_avx2(filtered + x * 2 + 32, acc2, acc3);
+            continue;
+        }
+
+        // Packing works per 128-bit lane, so the 4-byte groups come out as 0 2 4 6 1 3 5 7.
+        __m256i words01 = _mm256_packs_epi32(_mm256_cvttps_epi32(acc0), _mm256_cvttps_epi32(acc1));
+        __m256i words23 = _mm256_packs_epi32(_mm256_cvttps_epi32(acc2), _mm256_cvttps_epi32(acc3));
+        __m256i bytes = _mm256_packus_epi16(words01, words23);
+        _mm256_storeu_si256((__m256i *)(filtered + x), _mm256_permutevar8x32_epi32(bytes, interleave));
+    }
+
+    for (; x + 8 <= end; x += 8)
+    {
+        __m256 acc = _mm256_setzero_ps();
+        UNROLL_TAPS
+        for (int k = 0; k < taps; k++)
+        {
+            const unsigned char *tap = rows != NULL ? rows[k] + x * size : base + (x + k * step) * size;
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(load_widened_avx2(tap, source), _mm256_set1_ps(kernel[k])));
+        }
+
+        if (result == SAMPLE_UINT16_8_7)
+        {
+            __m256i dwords = _mm256_cvtps_epi32(acc);
+            __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(dwords), _mm256_extracti128_si256(dwords, 1));
+            _mm_storeu_si128((__m128i *)(filtered + x * 2), _mm_max_epi16(words, _mm_setzero_si128()));
+            continue;
+        }
+
+        __m256i dwords = _mm256_cvttps_epi32(acc);
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(dwords), _mm256_extracti128_si256(dwords, 1));
+        _mm_storel_epi64((__m128i *)(filtered + x), _mm_packus_epi16(words, words));
+    }
+
+    return x;
+}
+
+__attribute__((target("sse4.1"))) static inline __m128 load_widened_sse41(const unsigned char *src, SampleFormat format)
+{
+    if (format == SAMPLE_UINT8)
+    {
+        int packed;
+        __builtin_memcpy(&packed, src, sizeof(packed));
+        return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+    }
+
+    return _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)src)));
+}
+
+/* Rounds 8 results to SAMPLE_UINT16_8_7.*/
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i pack_wide_sse41(__m128 first, __m128 second)
+{
+    __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(first), _mm_cvtps_epi32(second));
+    return _mm_max_epi16(words, _mm_setzero_si128());
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline int filter_taps_sse41(unsigned char *filtered, const unsigned char *const *rows, const unsigned char *base, int step, int start, int end, const float *kernel, int taps, SampleFormat source, SampleFormat result)
+{
+    // 16 outputs in flight, 4 per accumulator.
+    int size = sample_size(source);
+    int x = start;
+    for (; x + 16 <= end; x += 16)
+    {
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(),
+               acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+        UNROLL_TAPS
+        for (int k = 0; k < taps; k++)
+        {
+            const unsigned char *tap = rows != NULL ? rows[k] + x * size : base + (x + k * step) * size;
+            __m128 weight = _mm_set1_ps(kernel[k]);
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(load_widened_sse41(tap, source), weight));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(load_widened_sse41(tap + 4 * size, source), weight));
+            acc2 = _mm_add_ps(acc2, _mm_mul_ps(load_widened_sse41(tap + 8 * size, source), weight));
+            acc3 = _mm_add_ps(acc3, _mm_mul_ps(load_widened_sse41(tap + 12 * size, source), weight));
+        }
+
+        if (result == SAMPLE_UINT16_8_7)
+        {
+            _mm_storeu_si128((__m128i *)(filtered + x * 2), pack_wide_sse41(acc0, acc1));
+            _mm_storeu_si128((__m128i *)(filtered + x * 2 + 16), pack_wide_sse41(acc2, acc3));
+            continue;
+        }
+
+        __m128i words01 = _mm_packs_epi32(_mm_cvttps_epi32(acc0), _mm_cvttps_epi32(acc1));
+        __m128i words23 = _mm_packs_epi32(_mm_cvttps_epi32(acc2), _mm_cvttps_epi32(acc3));
+        _mm_storeu_si128((__m128i *)(filtered + x), _mm_packus_epi16(words01, words23));
+    }
+
+    for (; x + 4 <= end; x += 4)
+    {
+        __m128 acc = _mm_setzero_ps();
+        UNROLL_TAPS
+        for (int k = 0; k < taps; k++)
+        {
+            const unsigned char *tap = rows != NULL ? rows[k] + x * size : base + (x + k * step) * size;
+            acc = _mm_add_ps(acc, _mm_mul_ps(load_widened_sse41(tap, source), _mm_set1_ps(kernel[k])));
+        }
+
+        if (result == SAMPLE_UINT16_8_7)
+        {
+            _mm_storel_epi64((__m128i *)(filtered + x * 2), pack_wide_sse41(acc, acc));
+            continue;
+        }
+
+        __m128i words = _mm_packs_epi32(_mm_cvttps_epi32(acc), _mm_setzero_si128());
+        int packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        __builtin_memcpy(filtered + x, &packed, sizeof(packed));
+    }
+
+    return x;
+}
+
+/*
+ * The Q0.15 kernels take taps in pairs. madd multiplies samples, uint8
+ * widened to int16 or SAMPLE_UINT16_8_7 as is, by their int16 weights and
+ * adds each pair into int32, so there are no float conversions. The
+ * accumulators start at half an output step, so the final shift, by 15 plus
+ * the source's fraction bits minus the result's, rounds to nearest.
+ */
+
+/* Right shift from a Q0.15 sum of `source` samples to a `result` sample.*/
+static inline int fixed_shift(SampleFormat source, SampleFormat result)
+{
+    return 15 + (source == SAMPLE_UINT16_8_7 ? 7 : 0) - (result == SAMPLE_UINT16_8_7 ? 7 : 0);
+}
+
+/* Both weights of a tap pair in every 32-bit lane, as madd expects them.*/
+static inline int weight_pair(const short *kernel, int k, int taps)
+{
+    unsigned int second = k + 1 < taps ? (unsigned short)kernel[k + 1] : 0;
+    return (int)((unsigned short)kernel[k] | (second << 16));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline __m256i load_words_avx2(const unsigned char *src, SampleFormat format)
+{
+    if (format == SAMPLE_UINT8)
+    {
+        return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)src));
+    }
+
+    return _mm256_loadu_si256((const __m256i *)src);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void accumulate_pair_avx2(__m256i *lo, __m256i *hi, const unsigned char *tap0, const unsigned char *tap1, __m256i weights, SampleFormat source)
+{
+    __m256i first = load_words_avx2(tap0, source);
+    __m256i second = load_words_avx2(tap1, source);
+    *lo = _mm256_add_epi32(*lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(first, second), weights));
+    *hi = _mm256_add_epi32(*hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(first, second), weights));
+}
+
+/* unpacklo/hi work per 128-bit lane, so lo holds outputs 0-3 and 8-11 and hi holds 4-7 and 12-15, which
+   packs_epi32 puts back in order. Stores 16 results.*/
+__attribute__((target("avx2"), always_inline)) static inline void store_fixed_avx2(unsigned char *filtered, __m256i lo, __m256i hi, __m128i shift, SampleFormat result)
+{
+    __m256i words = _mm256_packs_epi32(_mm256_sra_epi32(lo, shift), _mm256_sra_epi32(hi, shift));
+    if (result == SAMPLE_UINT16_8_7)
+    {
+        _mm256_storeu_si256((__m256i *)filtered, _mm256_max_epi16(words, _mm256_setzero_si256()));
+        return;
+    }
+
+    __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+    _mm_storeu_si128((__m128i *)filtered, _mm256_castsi256_si128(bytes));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline int filter_taps_fixed_avx2(unsigned char *filtered, const unsigned char *const *rows, const unsigned char *base, int step, int start, int end, const short *kernel, int taps, SampleFormat source, SampleFormat result)
+{
+    // 32 outputs in flight, 8 per accumulator. An odd last tap is paired with itself at weight zero.
+    const __m128i shift = _mm_cvtsi32_si128(fixed_shift(source, result));
+    const __m256i half = _mm256_set1_epi32(1 << (fixed_shift(source, result) - 1));
+    int size = sample_size(source);
+    int result_size = sample_size(result);
+    int x = start;
+    for (; x + 32 <= end; x += 32)
+    {
+        __m256i lo0 = half, hi0 = half, lo1 = half, hi1 = half;
+        UNROLL_TAPS
+        for (int k = 0; k < taps; k += 2)
+        {
+            int next = k + 1 < taps ? k + 1 : k;
+            const unsigned char *tap0 = rows != NULL ? rows[k] + x * size : base + (x + k * step) * size;
+            const unsigned char *tap1 = rows != NULL ? rows[next] + x * size : base + (x + next * step) * size;
+            __m256i weights = _mm256_set1_epi32(weight_pair(kernel, k, taps));
+            accumulate_pair_avx2(&lo0, &hi0, tap0, tap1, weights, source);
+            accumulate_pair_avx2(&lo1, &hi1, tap0 + 16 * size, tap1 + 16 * size, weights, source);
+        }
+
+        store_fixed_avx2(filtered + x * result_size, lo0, hi0, shift, result);
+        store_fixed_avx2(filtered + (x + 16) * result_size, lo1, hi1, shift, result);
+    }
+
+    for (; x + 16 <= end; x += 16)
+    {
+        __m256i lo = half, hi = half;
+        UNROLL_TAPS
+        for (int k = 0; k < taps; k += 2)
+        {
+            int next = k + 1 < taps ? k + 1 : k;
+            const unsigned char *tap0 = rows != NULL ? rows[k] + x * size : base + (x + k * step) * size;
+            const unsigned char *tap1 = rows != NULL ? rows[next] + x * size : base + (x + next * step) * size;
+            accumulate_pair_avx2(&lo, &hi, tap0, tap1, _mm256_set1_epi32(weight_pair(kernel, k, taps)), source);
+        }
+
+        store_fixed_avx2(filtered + x * result_size, lo, hi, shift, result);
+    }
+
+    return x;
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i load_words_sse41(const unsigned char *src, SampleFormat format)
+{
+    if (format == SAMPLE_UINT8)
+    {
+        return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)src));
+    }
+
+    return _mm_loadu_si128((const __m128i *)src);
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline void accumulate_pair_sse41(__m128i *lo, __m128i *hi, const unsigned char *tap0, const unsigned char *tap1, __m128i weights, SampleFormat source)
+{
+    __m128i first = load_words_sse41(tap0, source);
+    __m128i second = load_words_sse41(tap1, source);
+    *lo = _mm_add_epi32(*lo, _mm_madd_epi16(_mm_unpacklo_epi16(first, second), weights));
+    *hi = _mm_add_epi32(*hi, _mm_madd_epi16(_mm_unpackhi_epi16(first, second), weights));
+}
+
+/* Stores 8 results.*/
+__attribute__((target("sse4.1"), always_inline)) static inline void store_fixed_sse41(unsigned char *filtered, __m128i lo, __m128i hi, __m128i shift, SampleFormat result)
+{
+    __m128i words = _mm_packs_epi32(_mm_sra_epi32(lo, shift), _mm_sra_epi32(hi, shift));
+    if (result == SAMPLE_UINT16_8_7)
+    {
+        _mm_storeu_si128((__m128i *)filtered, _mm_max_epi16(words, _mm_setzero_si128()));
+        return;
+    }
+
+    _mm_storel_epi64((__m128i *)filtered, _mm_packus_epi16(words, words));
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline int filter_taps_fixed_sse41(unsigned char *filtered, const unsigned char *const *rows, const unsigned char *base, int step, int start, int end, const short *kernel, int taps, SampleFormat source, SampleFormat result)
+{
+    // 16 outputs in flight, 4 per accumulator.
+    const __m128i shift = _mm_cvtsi32_si128(fixed_shift(source, result));
+    const __m128i half = _mm_set1_epi32(1 << (fixed_shift(source, result) - 1));
+    int size = sample_size(source);
+    int result_size = sample_size(result);
+    int x = start;
+    for (; x + 16 <= end; x += 16)
+    {
+        __m128i lo0 = half, hi0 = half, lo1 = half, hi1 = half;
+        UNROLL_TAPS
+        for (int k = 0; k < taps; k += 2)
+        {
+            int next = k + 1 < taps ? k + 1 : k;
+            const unsigned char *tap0 = rows != NULL ? rows[k] + x * size : base + (x + k * step) * size;
+            const unsigned char *tap1 = rows != NULL ? rows[next] + x * size : base + (x + next * step) * size;
+            __m128i weights = _mm_set1_epi32(weight_pair(kernel, k, taps));
+            accumulate_pair_sse41(&lo0, &hi0, tap0, tap1, weights, source);
+            accumulate_pair_sse41(&lo1, &hi1, tap0 + 8 * size, tap1 + 8 * size, weights, source);
+        }
+
+        store_fixed_sse41(filtered + x * result_size, lo0, hi0, shift, result);
+        store_fixed_sse41(filtered + (x + 8) * result_size, lo1, hi1, shift, result);
+    }
+
+    for (; x + 8 <= end; x += 8)
+    {
+        __m128i lo = half, hi = half;
+        UNROLL_TAPS
+        for (int k = 0; k < taps; k += 2)
+        {
+            int next = k + 1 < taps ? k + 1 : k;
+            const unsigned char *tap0 = rows != NULL ? rows[k] + x * size : base + (x + k * step) * size;
+            const unsigned char *tap1 = rows != NULL ? rows[next] + x * size : base + (x + next * step) * size;
+            accumulate_pair_sse41(&lo, &hi, tap0, tap1, _mm_set1_epi32(weight_pair(kernel, k, taps)), source);
+        }
+
+        store_fixed_sse41(filtered + x * result_size, lo, hi, shift, result);
+    }
+
+    return x;
+}
+
+/*
+ * Layout conversions for 3 and 4 channels, 16 pixels per iteration. Four
+ * channels are a 4x4 transpose of 32-bit groups after gathering each
+ * pixel's channel bytes. Three channels use one pshufb per source vector
+ * and plane, with the lanes supplied by other vectors zeroed and or-ed in.
+ */
+
+/* pshufb masks for 3 channels. Deinterleaving, masks[ch][v] moves the bytes of channel ch in vector v of the 48
+   interleaved bytes to their plane positions. Interleaving, masks[v][ch] moves plane ch bytes to vector v.*/
+static void three_channel_masks(signed char masks[3][3][16], int interleave)
+{
+    for (int channel = 0; channel < 3; channel++)
+    {
+        for (int vector = 0; vector < 3; vector++)
+        {
+            for (int j = 0; j < 16; j++)
+            {
+                if (interleave)
+                {
+                    // Byte j of vector v holds channel (16v + j) % 3 of pixel (16v + j) / 3.
+                    int index = 16 * vector + j;
+                    masks[vector][channel][j] = index % 3 == channel ? index / 3 : -128;
+                }
+                else
+                {
+                    // Plane byte j is interleaved byte 3j + channel, which is byte 3j + channel - 16v of vector v.
+                    int index = 3 * j + channel - 16 * vector;
+                    masks[channel][vector][j] = index >= 0 && index < 16 ? index : -128;
+                }
+            }
+        }
+    }
+}
+
+__attribute__((target("sse4.1"))) static int deinterleave_sse41(unsigned char *const *planes, const unsigned char *pixels, int count, int channel_count)
+{
+    int i = 0;
+    if (channel_count == 4)
+    {
+        const __m128i gather = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i *src = (const __m128i *)(pixels + i * 4);
+            __m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128(src), gather);
+            __m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128(src + 1), gather);
+            __m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128(src + 2), gather);
+            __m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128(src + 3), gather);
+            __m128i t0 = _mm_unpacklo_epi32(v0, v1);
+            __m128i t1 = _mm_unpackhi_epi32(v0, v1);
+            __m128i t2 = _mm_unpacklo_epi32(v2, v3);
+            __m128i t3 = _mm_unpackhi_epi32(v2, v3);
+            _mm_storeu_si128((__m128i *)(planes[0] + i), _mm_unpacklo_epi64(t0, t2));
+            _mm_storeu_si128((__m128i *)(planes[1] + i), _mm_unpackhi_epi64(t0, t2));
+            _mm_storeu_si128((__m128i *)(planes[2] + i), _mm_unpacklo_epi64(t1, t3));
+            _mm_storeu_si128((__m128i *)(planes[3] + i), _mm_unpackhi_epi64(t1, t3));
+        }
+
+        return i;
+    }
+
+    signed char mask_bytes[3][3][16];
+    three_channel_masks(mask_bytes, 0);
+    __m128i masks[3][3];
+    for (int channel = 0; channel < 3; channel++)
+    {
+        for (int vector = 0; vector < 3; vector++)
+        {
+            masks[channel][vector] = _mm_loadu_si128((const __m128i *)mask_bytes[channel][vector]);
+        }
+    }
+
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i *src = (const __m128i *)(pixels + i * 3);
+        __m128i v0 = _mm_loadu_si128(src);
+        __m128i v1 = _mm_loadu_si128(src + 1);
+        __m128i v2 = _mm_loadu_si128(src + 2);
+        for (int channel = 0; channel < 3; channel++)
+        {
+            __m128i plane = _mm_or_si128(_mm_shuffle_epi8(v0, masks[channel][0]), _mm_shuffle_epi8(v1, masks[channel][1]));
+            plane = _mm_or_si128(plane, _mm_shuffle_epi8(v2, masks[channel][2]));
+            _mm_storeu_si128((__m128i *)(planes[channel] + i), plane);
+        }
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1"))) static int interleave_sse41(unsigned char *pixels, const unsigned char *const *planes, int count, int channel_count)
+{
+    int i = 0;
+    if (channel_count == 4)
+    {
+        // The same byte gather undoes itself once the transpose has been undone.
+        const __m128i scatter = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i p0 = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+            __m128i p1 = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+            __m128i p2 = _mm_loadu_si128((const __m128i *)(planes[2] + i));
+            __m128i p3 = _mm_loadu_si128((const __m128i *)(planes[3] + i));
+            __m128i t0 = _mm_unpacklo_epi32(p0, p1);
+            __m128i t1 = _mm_unpackhi_epi32(p0, p1);
+            __m128i t2 = _mm_unpacklo_epi32(p2, p3);
+            __m128i t3 = _mm_unpackhi_epi32(p2, p3);
+            __m128i *dst = (__m128i *)(pixels + i * 4);
+            _mm_storeu_si128(dst, _mm_shuffle_epi8(_mm_unpacklo_epi64(t0, t2), scatter));
+            _mm_storeu_si128(dst + 1, _mm_shuffle_epi8(_mm_unpackhi_epi64(t0, t2), scatter));
+            _mm_storeu_si128(dst + 2, _mm_shuffle_epi8(_mm_unpacklo_epi64(t1, t3), scatter));
+            _mm_storeu_si128(dst + 3, _mm_shuffle_epi8(_mm_unpackhi_epi64(t1, t3), scatter));
+        }
+
+        return i;
+    }
+
+    signed char mask_bytes[3][3][16];
+    three_channel_masks(mask_bytes, 1);
+    __m128i masks[3][3];
+    for (int vector = 0; vector < 3; vector++)
+    {
+        for (int channel = 0; channel < 3; channel++)
+        {
+            masks[vector][channel] = _mm_loadu_si128((const __m128i *)mask_bytes[vector][channel]);
+        }
+    }
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+        __m128i p2 = _mm_loadu_si128((const __m128i *)(planes[2] + i));
+        __m128i *dst = (__m128i *)(pixels + i * 3);
+        for (int vector = 0; vector < 3; vector++)
+        {
+            __m128i bytes = _mm_or_si128(_mm_shuffle_epi8(p0, masks[vector][0]), _mm_shuffle_epi8(p1, masks[vector][1]));
+            _mm_storeu_si128(dst + vector, _mm_or_si128(bytes, _mm_shuffle_epi8(p2, masks[vector][2])));
+        }
+    }
+
+    return i;
+}
+
+/* Multiplies and adds separately, like the scalar loop, so every ISA gives the same sums.*/
+__attribute__((target("avx2"))) static int multiply_add_avx2(float *sums, const float *samples, float weight, int count)
+{
+    __m256 weights = _mm256_set1_ps(weight);
+    int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m256 product = _mm256_mul_ps(_mm256_loadu_ps(samples + x), weights);
+        _mm256_storeu_ps(sums + x, _mm256_add_ps(_mm256_loadu_ps(sums + x), product));
+    }
+
+    return x;
+}
+
+__attribute__((target("sse4.1"))) static int multiply_add_sse41(float *sums, const float *samples, float weight, int count)
+{
+    __m128 weights = _mm_set1_ps(weight);
+    int x = 0;
+    for (; x + 4 <= count; x += 4)
+    {
+        __m128 product = _mm_mul_ps(_mm_loadu_ps(samples + x), weights);
+        _mm_storeu_ps(sums + x, _mm_add_ps(_mm_loadu_ps(sums + x), product));
+    }
+
+    return x;
+}
+
+/* Four vectors of sums stay in registers across all taps, so each tap costs one load per vector rather than the
+   load and store of a multiply_add pass. Taps are added in order, like the scalar loop.*/
+__attribute__((target("avx2"))) static int convolve_float_avx2(float *filtered, const float *samples, int step, const float *kernel, int taps, int count)
+{
+    int x = 0;
+    for (; x + 32 <= count; x += 32)
+    {
+        __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps(), sum2 = _mm256_setzero_ps(), sum3 = _mm256_setzero_ps();
+        for (int k = 0; k < taps; k++)
+        {
+            __m256 weights = _mm256_set1_ps(kernel[k]);
+            const float *base = samples + x + (size_t)k * step;
+            sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(base), weights));
+            sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(base + 8), weights));
+            sum2 = _mm256_add_ps(sum2, _mm256_mul_ps(_mm256_loadu_ps(base + 16), weights));
+            sum3 = _mm256_add_ps(sum3, _mm256_mul_ps(_mm256_loadu_ps(base + 24), weights));
+        }
+
+        _mm256_storeu_ps(filtered + x, sum0);
+        _mm256_storeu_ps(filtered + x + 8, sum1);
+        _mm256_storeu_ps(filtered + x + 16, sum2);
+        _mm256_storeu_ps(filtered + x + 24, sum3);
+    }
+
+    for (; x + 8 <= count; x += 8)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < taps; k++)
+        {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(samples + x + (size_t)k * step), _mm256_set1_ps(kernel[k])));
+        }
+
+        _mm256_storeu_ps(filtered + x, sum);
+    }
+
+    return x;
+}
+
+__attribute__((target("sse4.1"))) static int convolve_float_sse41(float *filtered, const float *samples, int step, const float *kernel, int taps, int count)
+{
+    int x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+        __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps(), sum2 = _mm_setzero_ps(), sum3 = _mm_setzero_ps();
+        for (int k = 0; k < taps; k++)
+        {
+            __m128 weights = _mm_set1_ps(kernel[k]);
+            const float *base = samples + x + (size_t)k * step;
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(base), weights));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(base + 4), weights));
+            sum2 = _mm_add_ps(sum2, _mm_mul_ps(_mm_loadu_ps(base + 8), weights));
+            sum3 = _mm_add_ps(sum3, _mm_mul_ps(_mm_loadu_ps(base + 12), weights));
+        }
+
+        _mm_storeu_ps(filtered + x, sum0);
+        _mm_storeu_ps(filtered + x + 4, sum1);
+        _mm_storeu_ps(filtered + x + 8, sum2);
+        _mm_storeu_ps(filtered + x + 12, sum3);
+    }
+
+    for (; x + 4 <= count; x += 4)
+    {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < taps; k++)
+        {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(samples + x + (size_t)k * step), _mm_set1_ps(kernel[k])));
+        }
+
+        _mm_storeu_ps(filtered + x, sum);
+    }
+
+    return x;
+}
+
+__attribute__((target("avx2"))) static int widen_avx2(float *widened, const unsigned char *samples, int count)
+{
+    int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m256i integers = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(samples + x)));
+        _mm256_storeu_ps(widened + x, _mm256_cvtepi32_ps(integers));
+    }
+
+    return x;
+}
+
+__attribute__((target("sse4.1"))) static int widen_sse41(float *widened, const unsigned char *samples, int count)
+{
+    int x = 0;
+    for (; x + 4 <= count; x += 4)
+    {
+        int packed;
+        memcpy(&packed, samples + x, sizeof(packed));
+        _mm_storeu_ps(widened + x, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed))));
+    }
+
+    return x;
+}
+
+/* Adds the offset, clamps to [0, 255] and truncates, the same steps as the scalar conversion.*/
+__attribute__((target("avx2"))) static int narrow_avx2(unsigned char *narrowed, const float *samples, float offset, int count)
+{
+    __m256 offsets = _mm256_set1_ps(offset), low = _mm256_setzero_ps(), high = _mm256_set1_ps(255);
+    int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m256 clamped = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(samples + x), offsets), low), high);
+        __m256i integers = _mm256_cvttps_epi32(clamped);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(integers), _mm256_extracti128_si256(integers, 1));
+        _mm_storel_epi64((__m128i *)(narrowed + x), _mm_packus_epi16(words, words));
+    }
+
+    return x;
+}
+
+__attribute__((target("sse4.1"))) static int narrow_sse41(unsigned char *narrowed, const float *samples, float offset, int count)
+{
+    __m128 offsets = _mm_set1_ps(offset), low = _mm_setzero_ps(), high = _mm_set1_ps(255);
+    int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128i first = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_loadu_ps(samples + x), offsets), low), high));
+        __m128i second = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_loadu_ps(samples + x + 4), offsets), low), high));
+        __m128i words = _mm_packus_epi32(first, second);
+        _mm_storel_epi64((__m128i *)(narrowed + x), _mm_packus_epi16(words, words));
+    }
+
+    return x;
+}
+
+/* Unsharp masking between byte rows, with the blur offset added and the result narrowed as narrow_avx2 does.*/
+__attribute__((target("avx2"))) static int sharpen_bytes_avx2(unsigned char *sharpened, const unsigned char *samples, const unsigned char *blurred, float amount, float threshold, float blur_offset, int count)
+{
+    __m256 amounts = _mm256_set1_ps(amount), thresholds = _mm256_set1_ps(threshold), offsets = _mm256_set1_ps(blur_offset);
+    __m256 sign = _mm256_set1_ps(-0.0f), half = _mm256_set1_ps(0.5f), low = _mm256_setzero_ps(), high = _mm256_set1_ps(255);
+    int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m256 sample = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(samples + x))));
+        __m256 blur = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(blurred + x)))), offsets);
+        __m256 difference = _mm256_sub_ps(sample, blur);
+        __m256 below = _mm256_cmp_ps(_mm256_andnot_ps(sign, difference), thresholds, _CMP_LT_OQ);
+        __m256 result = _mm256_blendv_ps(_mm256_add_ps(sample, _mm256_mul_ps(amounts, difference)), sample, below);
+        __m256i integers = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_add_ps(result, half), low), high));
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(integers), _mm256_extracti128_si256(integers, 1));
+        _mm_storel_epi64((__m128i *)(sharpened + x), _mm_packus_epi16(words, words));
+    }
+
+    return x;
+}
+
+__attribute__((target("sse4.1"))) static int sharpen_bytes_sse41(unsigned char *sharpened, const unsigned char *samples, const unsigned char *blurred, float amount, float threshold, float blur_offset, int count)
+{
+    __m128 amounts = _mm_set1_ps(amount), thresholds = _mm_set1_ps(threshold), offsets = _mm_set1_ps(blur_offset);
+    __m128 sign = _mm_set1_ps(-0.0f), half = _mm_set1_ps(0.5f), low = _mm_setzero_ps(), high = _mm_set1_ps(255);
+    int x = 0;
+    for (; x + 4 <= count; x += 4)
+    {
+        int packed_samples, packed_blurred;
+        memcpy(&packed_samples, samples + x, sizeof(packed_samples));
+        memcpy(&packed_blurred, blurred + x, sizeof(packed_blurred));
+        __m128 sample = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed_samples)));
+        __m128 blur = _mm_add_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed_blurred))), offsets);
+        __m128 difference = _mm_sub_ps(sample, blur);
+        __m128 below = _mm_cmplt_ps(_mm_andnot_ps(sign, difference), thresholds);
+        __m128 result = _mm_blendv_ps(_mm_add_ps(sample, _mm_mul_ps(amounts, difference)), sample, below);
+        __m128i integers = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(result, half), low), high));
+        __m128i words = _mm_packus_epi32(integers, integers);
+        int narrowed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        memcpy(sharpened + x, &narrowed, sizeof(narrowed));
+    }
+
+    return x;
+}
+
+/*
+ * Variants for small kernels, with the tap count and, for 1, 3 and 4 channels, the horizontal step as
+ * constants. Tap offsets then fold into the addressing and the tap loop unrolls completely. Steps other
+ * than 1, 3 and 4, such as the row width of vertical passes, get the variant with only the tap count
+ * fixed. Only filters between uint8 samples are specialized; conversions to and from SAMPLE_UINT16_8_7
+ * get the generic entry points.
+ */
+#define ROW_FILTER_VARIANT(name, body, isa_target, weight_type, step_value, taps_value, source, result)                                              \
+    __attribute__((target(isa_target))) static int name(unsigned char *filtered, const unsigned char *base, int step, int start, int end, const weight_type *kernel, int taps) \
+    {                                                                                                                                              \
+        return body(filtered, NULL, base, step_value, start, end, kernel, taps_value, source, result);                                            \
+    }
+
+#define ROWS_FILTER_VARIANT(name, body, isa_target, weight_type, taps_value, source)                                                              \
+    __attribute__((target(isa_target))) static int name(unsigned char *filtered, const unsigned char *const *rows, int start, int end, const weight_type *kernel, int taps) \
+    {                                                                                                                                              \
+        return body(filtered, rows, NULL, 0, start, end, kernel, taps_value, source, SAMPLE_UINT8);                                               \
+    }
+
+/* Entry points with neither the step nor the tap count fixed, for every supported pair of formats.*/
+#define GENERIC_VARIANTS(prefix, body, isa_target, weight_type)                                                      \
+    ROW_FILTER_VARIANT(prefix, body, isa_target, weight_type, step, taps, SAMPLE_UINT8, SAMPLE_UINT8)                 \
+    ROW_FILTER_VARIANT(prefix##_widening, body, isa_target, weight_type, step, taps, SAMPLE_UINT8, SAMPLE_UINT16_8_7) \
+    ROW_FILTER_VARIANT(prefix##_narrowing, body, isa_target, weight_type, step, taps, SAMPLE_UINT16_8_7, SAMPLE_UINT8) \
+    ROWS_FILTER_VARIANT(prefix##_rows, body, isa_target, weight_type, taps, SAMPLE_UINT8)                            \
+    ROWS_FILTER_VARIANT(prefix##_rows_narrowing, body, isa_target, weight_type, taps, SAMPLE_UINT16_8_7)
+
+#define RADIUS_VARIANTS(prefix, body, isa_target, weight_type, radius)                                                     \
+    ROW_FILTER_VARIANT(prefix##_any_r##radius, body, isa_target, weight_type, step, 2 * radius + 1, SAMPLE_UINT8, SAMPLE_UINT8) \
+    ROW_FILTER_VARIANT(prefix##_c1_r##radius, body, isa_target, weight_type, 1, 2 * radius + 1, SAMPLE_UINT8, SAMPLE_UINT8)     \
+    ROW_FILTER_VARIANT(prefix##_c3_r##radius, body, isa_target, weight_type, 3, 2 * radius + 1, SAMPLE_UINT8, SAMPLE_UINT8)     \
+    ROW_FILTER_VARIANT(prefix##_c4_r##radius, body, isa_target, weight_type, 4, 2 * radius + 1, SAMPLE_UINT8, SAMPLE_UINT8)     \
+    ROWS_FILTER_VARIANT(prefix##_rows_r##radius, body, isa_target, weight_type, 2 * radius + 1, SAMPLE_UINT8)
+
+#define SPECIALIZED_VARIANTS(prefix, body, isa_target, weight_type) \
+    RADIUS_VARIANTS(prefix, body, isa_target, weight_type, 1)       \
+    RADIUS_VARIANTS(prefix, body, isa_target, weight_type, 2)       \
+    RADIUS_VARIANTS(prefix, body, isa_target, weight_type, 3)       \
+    RADIUS_VARIANTS(prefix, body, isa_target, weight_type, 4)       \
+    RADIUS_VARIANTS(prefix, body, isa_target, weight_type, 5)       \
+    RADIUS_VARIANTS(prefix, body, isa_target, weight_type, 6)       \
+    RADIUS_VARIANTS(prefix, body, isa_target, weight_type, 7)       \
+    RADIUS_VARIANTS(prefix, body, isa_target, weight_type, 8)
+
+#define RADIUS_TABLE(prefix) {prefix##1, prefix##2, prefix##3, prefix##4, prefix##5, prefix##6, prefix##7, prefix##8}
+
+/* Row filter tables are indexed by variant_step, then radius - 1.*/
+#define ROW_FILTER_TABLE(prefix) {RADIUS_TABLE(prefix##_any_r), RADIUS_TABLE(prefix##_c1_r), RADIUS_TABLE(prefix##_c3_r), RADIUS_TABLE(prefix##_c4_r)}
+
+/* Generic row filter tables are indexed by variant_formats, rows filter tables by the source format.*/
+#define GENERIC_ROW_FILTER_TABLE(prefix) {&prefix, &prefix##_widening, &prefix##_narrowing}
+#define GENERIC_ROWS_FILTER_TABLE(prefix) {&prefix##_rows, &prefix##_rows_narrowing}
+
+GENERIC_VARIANTS(filter_avx2, filter_taps_avx2, "avx2", float)
+GENERIC_VARIANTS(filter_sse41, filter_taps_sse41, "sse4.1", float)
+GENERIC_VARIANTS(filter_fixed_avx2, filter_taps_fixed_avx2, "avx2", short)
+GENERIC_VARIANTS(filter_fixed_sse41, filter_taps_fixed_sse41, "sse4.1", short)
+
+SPECIALIZED_VARIANTS(filter_avx2, filter_taps_avx2, "avx2", float)
+SPECIALIZED_VARIANTS(filter_sse41, filter_taps_sse41, "sse4.1", float)
+SPECIALIZED_VARIANTS(filter_fixed_avx2, filter_taps_fixed_avx2, "avx2", short)
+SPECIALIZED_VARIANTS(filter_fixed_sse41, filter_taps_fixed_sse41, "sse4.1", short)
+
+static const row_filter_fun generic_row_filters_avx2[3] = GENERIC_ROW_FILTER_TABLE(filter_avx2);
+static const row_filter_fun generic_row_filters_sse41[3] = GENERIC_ROW_FILTER_TABLE(filter_sse41);
+static const rows_filter_fun generic_rows_filters_avx2[2] = GENERIC_ROWS_FILTER_TABLE(filter_avx2);
+static const rows_filter_fun generic_rows_filters_sse41[2] = GENERIC_ROWS_FILTER_TABLE(filter_sse41);
+static const fixed_row_filter_fun generic_fixed_row_filters_avx2[3] = GENERIC_ROW_FILTER_TABLE(filter_fixed_avx2);
+static const fixed_row_filter_fun generic_fixed_row_filters_sse41[3] = GENERIC_ROW_FILTER_TABLE(filter_fixed_sse41);
+static const fixed_rows_filter_fun generic_fixed_rows_filters_avx2[2] = GENERIC_ROWS_FILTER_TABLE(filter_fixed_avx2);
+static const fixed_rows_filter_fun generic_fixed_rows_filters_sse41[2] = GENERIC_ROWS_FILTER_TABLE(filter_fixed_sse41);
+
+static const row_filter_fun row_filters_avx2[4][SPECIALIZED_MAX_RADIUS] = ROW_FILTER_TABLE(filter_avx2);
+static const row_filter_fun row_filters_sse41[4][SPECIALIZED_MAX_RADIUS] = ROW_FILTER_TABLE(filter_sse41);
+static const rows_filter_fun rows_filters_avx2[SPECIALIZED_MAX_RADIUS] = RADIUS_TABLE(filter_avx2_rows_r);
+static const rows_filter_fun rows_filters_sse41[SPECIALIZED_MAX_RADIUS] = RADIUS_TABLE(filter_sse41_rows_r);
+static const fixed_row_filter_fun fixed_row_filters_avx2[4][SPECIALIZED_MAX_RADIUS] = ROW_FILTER_TABLE(filter_fixed_avx2);
+static const fixed_row_filter_fun fixed_row_filters_sse41[4][SPECIALIZED_MAX_RADIUS] = ROW_FILTER_TABLE(filter_fixed_sse41);
+static const fixed_rows_filter_fun fixed_rows_filters_avx2[SPECIALIZED_MAX_RADIUS] = RADIUS_TABLE(filter_fixed_avx2_rows_r);
+static const fixed_rows_filter_fun fixed_rows_filters_sse41[SPECIALIZED_MAX_RADIUS] = RADIUS_TABLE(filter_fixed_sse41_rows_r);
+
+/* Radius of the variants for `taps`, or 0 when only the generic filters apply.*/
+static int variant_radius(int taps)
+{
+    int radius = (taps - 1) / 2;
+    return taps % 2 == 1 && radius >= 1 && radius <= SPECIALIZED_MAX_RADIUS ? radius : 0;
+}
+
+static int variant_step(int step)
+{
+    switch (step)
+    {
+    case 1:
+        return 1;
+    case 3:
+        return 2;
+    case 4:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+/* Index into the generic row filter tables, or -1 for a pair of formats without filters.*/
+static int variant_formats(SampleFormat source, SampleFormat result)
+{
+    if (source == SAMPLE_UINT8)
+    {
+        return result == SAMPLE_UINT8 ? 0 : 1;
+    }
+
+    return result == SAMPLE_UINT8 ? 2 : -1;
+}
+
+row_filter_fun select_row_filter(int step, int taps, SampleFormat source, SampleFormat result)
+{
+    __builtin_cpu_init();
+    int radius = variant_radius(taps);
+    int formats = variant_formats(source, result);
+    if (formats < 0)
+    {
+        return NULL;
+    }
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return radius > 0 && formats == 0 ? row_filters_avx2[variant_step(step)][radius - 1] : generic_row_filters_avx2[formats];
+    }
+
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return radius > 0 && formats == 0 ? row_filters_sse41[variant_step(step)][radius - 1] : generic_row_filters_sse41[formats];
+    }
+
+    return NULL;
+}
+
+rows_filter_fun select_rows_filter(int taps, SampleFormat source)
+{
+    __builtin_cpu_init();
+    int radius = variant_radius(taps);
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return radius > 0 && source == SAMPLE_UINT8 ? rows_filters_avx2[radius - 1] : generic_rows_filters_avx2[source];
+    }
+
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return radius > 0 && source == SAMPLE_UINT8 ? rows_filters_sse41[radius - 1] : generic_rows_filters_sse41[source];
+    }
+
+    return NULL;
+}
+
+fixed_row_filter_fun select_fixed_row_filter(int step, int taps, SampleFormat source, SampleFormat result)
+{
+    __builtin_cpu_init();
+    int radius = variant_radius(taps);
+    int formats = variant_formats(source, result);
+    if (formats < 0)
+    {
+        return NULL;
+    }
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return radius > 0 && formats == 0 ? fixed_row_filters_avx2[variant_step(step)][radius - 1] : generic_fixed_row_filters_avx2[formats];
+    }
+
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return radius > 0 && formats == 0 ? fixed_row_filters_sse41[variant_step(step)][radius - 1] : generic_fixed_row_filters_sse41[formats];
+    }
+
+    return NULL;
+}
+
+fixed_rows_filter_fun select_fixed_rows_filter(int taps, SampleFormat source)
+{
+    __builtin_cpu_init();
+    int radius = variant_radius(taps);
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return radius > 0 && source == SAMPLE_UINT8 ? fixed_rows_filters_avx2[radius - 1] : generic_fixed_rows_filters_avx2[source];
+    }
+
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return radius > 0 && source == SAMPLE_UINT8 ? fixed_rows_filters_sse41[radius - 1] : generic_fixed_rows_filters_sse41[source];
+    }
+
+    return NULL;
+}
+
+#else
+
+row_filter_fun select_row_filter(int step, int taps, SampleFormat source, SampleFormat result)
+{
+    return NULL;
+}
+
+rows_filter_fun select_rows_filter(int taps, SampleFormat source)
+{
+    return NULL;
+}
+
+fixed_row_filter_fun select_fixed_row_filter(int step, int taps, SampleFormat source, SampleFormat result)
+{
+    return NULL;
+}
+
+fixed_rows_filter_fun select_fixed_rows_filter(int taps, SampleFormat source)
+{
+    return NULL;
+}
+
+#endif
+
+void deinterleave_pixels(unsigned char *const *planes, const unsigned char *pixels, int count, int channel_count)
+{
+    int i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if ((channel_count == 3 || channel_count == 4) && __builtin_cpu_supports("sse4.1"))
+    {
+        i = deinterleave_sse41(planes, pixels, count, channel_count);
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        for (int channel = 0; channel < channel_count; channel++)
+        {
+            planes[channel][i] = pixels[i * channel_count + channel];
+        }
+    }
+}
+
+void interleave_pixels(unsigned char *pixels, const unsigned char *const *planes, int count, int channel_count)
+{
+    int i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if ((channel_count == 3 || channel_count == 4) && __builtin_cpu_supports("sse4.1"))
+    {
+        i = interleave_sse41(pixels, planes, count, channel_count);
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        for (int channel = 0; channel < channel_count; channel++)
+        {
+            pixels[i * channel_count + channel] = planes[channel][i];
+        }
+    }
+}
+
+void multiply_add_row(float *sums, const float *samples, float weight, int count)
+{
+    int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        x = multiply_add_avx2(sums, samples, weight, count);
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        x = multiply_add_sse41(sums, samples, weight, count);
+    }
+#endif
+
+    for (; x < count; x++)
+    {
+        sums[x] += weight * samples[x];
+    }
+}
+
+void convolve_float_row(float *filtered, const float *samples, int step, const float *kernel, int taps, int count)
+{
+    int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        x = convolve_float_avx2(filtered, samples, step, kernel, taps, count);
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        x = convolve_float_sse41(filtered, samples, step, kernel, taps, count);
+    }
+#endif
+
+    for (; x < count; x++)
+    {
+        float sum = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            sum += kernel[k] * samples[x + (size_t)k * step];
+        }
+
+        filtered[x] = sum;
+    }
+}
+
+void widen_row(float *widened, const unsigned char *samples, int count)
+{
+    int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        x = widen_avx2(widened, samples, count);
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        x = widen_sse41(widened, samples, count);
+    }
+#endif
+
+    for (; x < count; x++)
+    {
+        widened[x] = samples[x];
+    }
+}
+
+void narrow_row(unsigned char *narrowed, const float *samples, float offset, int count)
+{
+    int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        x = narrow_avx2(narrowed, samples, offset, count);
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        x = narrow_sse41(narrowed, samples, offset, count);
+    }
+#endif
+
+    for (; x < count; x++)
+    {
+        float result = samples[x] + offset;
+        narrowed[x] = result < 0 ? 0 : (result > 255 ? 255 : result);
+    }
+}
+
+void sharpen_bytes_row(unsigned char *sharpened, const unsigned char *samples, const unsigned char *blurred, float amount, float threshold, float blur_offset, int count)
+{
+    int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        x = sharpen_bytes_avx2(sharpened, samples, blurred, amount, threshold, blur_offset, count);
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        x = sharpen_bytes_sse41(sharpened, samples, blurred, amount, threshold, blur_offset, count);
+    }
+#endif
+
+    for (; x < count; x++)
+    {
+        float difference = samples[x] - (blurred[x] + blur_offset);
+        float result = (fabsf(difference) < threshold ? samples[x] : samples[x] + amount * difference) + 0.5f;
+        sharpened[x] = result < 0 ? 0 : (result > 255 ? 255 : result);
+    }
+}
@@ -0,0 +1,62 @@
+/* Formats of the samples a row filter reads and writes. SAMPLE_UINT16_8_7 keeps 7 fraction bits in a uint16,
+   saturated to [0, 32767] so it also fits int16. It is used for the rows between the horizontal and vertical
+   passes, which would otherwise be rounded to bytes.*/
+typedef enum SampleFormat
+{
+    SAMPLE_UINT8,
+    SAMPLE_UINT16_8_7,
+} SampleFormat;
+
+/* Convolves a run of samples with a float kernel, filtered[x] = sum of kernel[k] * base[x + k * step] for k < taps.
+   Horizontal passes step by channel_count, vertical passes by the row width. Returns the first x in [start, end)
+   that was not filtered; the caller finishes the tail with the scalar path. Offsets count samples of the formats
+   the filter was selected for, so uint16 rows are passed as byte pointers.*/
+typedef int (*row_filter_fun)(unsigned char *filtered, const unsigned char *base, int step, int start, int end, const float *kernel, int taps);
+
+/* Picks the widest row filter the CPU supports for `taps` taps spaced `step` apart, reading `source` samples and
+   writing `result` samples, or NULL when only the scalar path is available. uint8 results are truncated and
+   SAMPLE_UINT16_8_7 results rounded to nearest; the float weights carry the 2^7 scale between the formats.
+   Between uint8 samples, kernels of radius 1 to 8 get variants with the tap count, and the step for 1, 3 and 4
+   channels, compiled in. The filter must be called with the same step and taps.*/
+row_filter_fun select_row_filter(int step, int taps, SampleFormat source, SampleFormat result);
+
+/* Same as row_filter_fun, but tap k of output x reads rows[k][x]. Used by vertical passes whose rows
+   are not evenly spaced, such as rows in a ring buffer or repeated edge rows.*/
+typedef int (*rows_filter_fun)(unsigned char *filtered, const unsigned char *const *rows, int start, int end, const float *kernel, int taps);
+
+/* Picks the widest rows filter the CPU supports for `taps` taps of `source` samples, or NULL when only the scalar
+   path is available. Rows filters always write uint8.*/
+rows_filter_fun select_rows_filter(int taps, SampleFormat source);
+
+/* Fixed-point counterparts of row_filter_fun and rows_filter_fun. Weights are Q0.15, accumulated in 32 bits
+   and rounded to nearest on output, shifted by the difference in fraction bits between the formats.*/
+typedef int (*fixed_row_filter_fun)(unsigned char *filtered, const unsigned char *base, int step, int start, int end, const short *kernel, int taps);
+
+typedef int (*fixed_rows_filter_fun)(unsigned char *filtered, const unsigned char *const *rows, int start, int end, const short *kernel, int taps);
+
+fixed_row_filter_fun select_fixed_row_filter(int step, int taps, SampleFormat source, SampleFormat result);
+
+fixed_rows_filter_fun select_fixed_rows_filter(int taps, SampleFormat source);
+
+/* Splits `count` pixels of channel_count interleaved channels into planes[0] to planes[channel_count - 1].*/
+void deinterleave_pixels(unsigned char *const *planes, const unsigned char *pixels, int count, int channel_count);
+
+/* Inverse of deinterleave_pixels.*/
+void interleave_pixels(unsigned char *pixels, const unsigned char *const *planes, int count, int channel_count);
+
+/* sums[x] += weight * samples[x] for x < count, for kernels that do not separate.*/
+void multiply_add_row(float *sums, const float *samples, float weight, int count);
+
+/* filtered[x] = sum of kernel[k] * samples[x + k * step] for k < taps and x < count, between float rows.*/
+void convolve_float_row(float *filtered, const float *samples, int step, const float *kernel, int taps, int count);
+
+/* Converts `count` bytes to floats, and floats back to bytes saturated, with offset added before truncating: 0.5
+   rounds to nearest, 0 truncates like the separable passes.*/
+void widen_row(float *widened, const unsigned char *samples, int count);
+
+void narrow_row(unsigned char *narrowed, const float *samples, float offset, int count);
+
+/* Unsharp masking between byte rows: sharpened[x] becomes samples[x] + amount * (samples[x] - blurred[x]), or
+   samples[x] where the two differ by less than threshold, with blur_offset added to the blurred samples and the
+   result rounded to nearest and saturated. sharpened may be samples or blurred.*/
+void sharpen_bytes_row(unsigned char *sharpened, const unsigned char *samples, const unsigned char *blurred, float amount, float threshold, float blur_offset, int count);
@@ -49,7 +49,7 @@ void gl_draw(GLFWwindow **window, unsigned char *image, int width, int height, i
             int i = x + y * width * channel_count;
             glColor3f(image[i] / 255.0f, image[i + 1] / 255.0f, image[i + 2] / 255.0f);
             // glVertex2f(0, 0);
-            glVertex2f(2 / 3.0 * (float)x / width - 1, -(2 * (float)y / height - 1));
+            glVertex2f(2.0 / channel_count * x / width - 1, -(2 * (float)y / height - 1));
         }
     }
     glEnd();
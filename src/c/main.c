@@ -2,6 +2,7 @@
 #include "filterimage.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 static int render_count = 0;
@@ -10,9 +11,11 @@ static unsigned char *original_image_buffer = 0;
 static unsigned char *image_buffer = 0;
 static int image_w = 0, image_h = 0, image_size = 0;
 static double kernel_radius = 0;
+static filter_options options;
 
 #ifdef CL
 static cl_handle *handle = 0;
+static const char *cl_device_selector = NULL;
 
 void render(GLFWwindow **window)
 {
@@ -43,8 +46,94 @@ int main(int argc, const char *argv[])
     const char *kernel_radius_str = argv[2];
     kernel_radius = strtol(kernel_radius_str, NULL, 10);
 
+    // Optional arguments: a thread count and --flags.
+    options = filter_default_options();
+#ifndef CL
+    int report_iir_accuracy = 0;
+#endif
+    int disc = 0;
+    float gamma = 0;
+    float unsharp_amount = 0;
+    int unsharp_threshold = 0;
+    for (int i = 3; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--iir-crossover=", 16) == 0)
+        {
+            options.iir_crossover_radius = strtol(argv[i] + 16, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--gaussian-approx", 17) == 0)
+        {
+            options.gaussian_mode = GAUSSIAN_APPROX;
+            if (argv[i][17] == '=')
+            {
+                options.gaussian_approx_passes = strtol(argv[i] + 18, NULL, 10);
+            }
+        }
+        else if (strncmp(argv[i], "--pyramid", 9) == 0)
+        {
+            options.gaussian_mode = GAUSSIAN_PYRAMID;
+            if (argv[i][9] == '=')
+            {
+                options.pyramid_error_budget = strtof(argv[i] + 10, NULL);
+            }
+        }
+        else if (strncmp(argv[i], "--low-rank-tolerance=", 21) == 0)
+        {
+            options.low_rank_tolerance = strtof(argv[i] + 21, NULL);
+        }
+        else if (strcmp(argv[i], "--fixed-point") == 0)
+        {
+            options.arithmetic = ARITHMETIC_FIXED_Q15;
+        }
+        else if (strcmp(argv[i], "--wide-intermediate") == 0)
+        {
+            options.intermediate_format = INTERMEDIATE_UINT16;
+        }
+        else if (strncmp(argv[i], "--gamma=", 8) == 0)
+        {
+            gamma = strtof(argv[i] + 8, NULL);
+        }
+        else if (strncmp(argv[i], "--unsharp=", 10) == 0)
+        {
+            // --unsharp=amount[,threshold]
+            char *end;
+            unsharp_amount = strtof(argv[i] + 10, &end);
+            if (*end == ',')
+            {
+                unsharp_threshold = strtol(end + 1, NULL, 10);
+            }
+        }
+#ifdef CL
+        else if (strncmp(argv[i], "--cl-device=", 12) == 0)
+        {
+            // gpu, cpu, accelerator, an index or part of a name. Also read from $CL_DEVICE.
+            cl_device_selector = argv[i] + 12;
+        }
+        else if (strcmp(argv[i], "--cl-devices") == 0)
+        {
+            printf("OpenCL devices:\n");
+            cl_list_devices();
+            exit(0);
+        }
+#endif
+        else if (strcmp(argv[i], "--disc") == 0)
+        {
+            disc = 1;
+        }
+#ifndef CL
+        else if (strcmp(argv[i], "--iir-accuracy") == 0)
+        {
+            report_iir_accuracy = 1;
+        }
+#endif
+        else
+        {
+            options.threads = strtol(argv[i], NULL, 10);
+        }
+    }
+
     unsigned int error;
-    error = lodepng_decode_file(&image_buffer, &image_w, &image_h, filename, LCT_RGB, 8);
+    error = lodepng_decode_file(&image_buffer, &image_w, &image_h, filename, LCT_RGBA, 8);
     if (error)
     {
         if (image_buffer != 0)
@@ -53,15 +142,17 @@ int main(int argc, const char *argv[])
         exit(error);
     }
 
-    channel_count = 3;
+    // Filtering works on premultiplied alpha, so transparent pixels do not bleed their color into the image.
+    channel_count = 4;
     image_size = image_w * image_h * channel_count;
+    premultiply_alpha(&image_buffer, image_w, image_h, options.threads);
 
     original_image_buffer = malloc(image_size);
     memcpy(original_image_buffer, image_buffer, image_size);
 
     printf("Image details:\n");
     printf("\tDimensions: (%i, %i)\n", image_w, image_h);
-    printf("\tColor channels: 3 (RGB)\n");
+    printf("\tColor channels: 4 (RGBA)\n");
     printf("\tBit depth: 8\n");
 
 #ifdef CL
@@ -71,19 +162,89 @@ int main(int argc, const char *argv[])
     glfwSetScrollCallback(window, scroll_callback);
 
     handle = malloc(sizeof(cl_handle));
-    cl_init(handle, cl_string);
+    cl_init(handle, cl_string, cl_device_selector);
     filter_cl(handle, &image_buffer, image_w, image_h, channel_count, kernel_radius, &gaussian_kernel_fun, REPEAT);
 
     gl_loop(&window, &render, &window_size_changed);
 
     cl_terminate(handle);
 #else
-    image_buffer = *filter(&image_buffer, image_w, image_h, channel_count, kernel_radius, &gaussian_kernel_fun, REPEAT);
+    if (report_iir_accuracy)
+    {
+        report_gaussian_iir_accuracy(&image_buffer, image_w, image_h, channel_count, kernel_radius, REPEAT, &options);
+    }
+
+    if (disc)
+    {
+        int taps = 2 * (int)kernel_radius + 1;
+        float *kernel = malloc(taps * taps * sizeof(float));
+        create_disc_kernel(kernel, kernel_radius);
+        image_buffer = *filter_2d(&image_buffer, image_w, image_h, channel_count, kernel, kernel_radius, REPEAT, &options);
+        free(kernel);
+    }
+    else if (gamma > 0)
+    {
+        // Blur and tone curve in one traversal. The curve leaves alpha alone.
+        unsigned char curve[256];
+        for (int i = 0; i < 256; i++)
+        {
+            curve[i] = 255 * powf(i / 255.0f, 1 / gamma) + 0.5f;
+        }
+
+        filter_pipeline pipeline;
+        filter_pipeline_init(&pipeline);
+        filter_pipeline_add_blur(&pipeline, kernel_radius, &gaussian_kernel_fun);
+        filter_pipeline_add_tone_curve(&pipeline, curve, 0x7);
+        image_buffer = *filter_pipeline_run(&pipeline, &image_buffer, image_w, image_h, channel_count, REPEAT, &options);
+    }
+    else if (unsharp_amount > 0)
+    {
+        image_buffer = *unsharp_mask(&image_buffer, image_w, image_h, channel_count, kernel_radius, unsharp_amount, unsharp_threshold, REPEAT, &options);
+    }
+    else
+    {
+        image_buffer = *filter(&image_buffer, image_w, image_h, channel_count, kernel_radius, &gaussian_kernel_fun, REPEAT, &options);
+    }
 #endif
 
     printf("Filter options:\n");
     printf("\tKernel radius: %li\n", kernel_radius);
     printf("\tOverflow behaviour: %i\n", REPEAT);
+    printf("\tThreads: %i\n", options.threads);
+    printf("\tIIR crossover radius: %i\n", options.iir_crossover_radius);
+    if (disc)
+    {
+        printf("\tKernel: disc (FFT from radius %i, low-rank tolerance %.1f)\n", options.fft_crossover_radius, options.low_rank_tolerance);
+    }
+
+    if (gamma > 0)
+    {
+        printf("\tPipeline: blur, then gamma %.2f\n", gamma);
+    }
+
+    if (unsharp_amount > 0)
+    {
+        printf("\tUnsharp mask: amount %.2f, threshold %i\n", unsharp_amount, unsharp_threshold);
+    }
+
+    if (options.gaussian_mode == GAUSSIAN_APPROX)
+    {
+        printf("\tGaussian approximation: %i box passes\n", options.gaussian_approx_passes);
+    }
+    else if (options.gaussian_mode == GAUSSIAN_PYRAMID)
+    {
+        printf("\tGaussian pyramid: %i levels (error budget %.1f)\n", filter_pyramid_levels(image_w, image_h, kernel_radius, &options), options.pyramid_error_budget);
+    }
+
+    if (options.arithmetic == ARITHMETIC_FIXED_Q15)
+    {
+        printf("\tArithmetic: fixed point (Q0.15)\n");
+    }
+
+    if (options.intermediate_format == INTERMEDIATE_UINT16)
+    {
+        printf("\tIntermediate rows: uint16 (7 fraction bits)\n");
+    }
 
     char *new_filename;
     if (asprintf(&new_filename, "%s.filtered.png", filename) == -1)
@@ -92,9 +253,11 @@ int main(int argc, const char *argv[])
         exit(-1);
     }
 
+    unpremultiply_alpha(&image_buffer, image_w, image_h, options.threads);
+
     unsigned char *png;
     size_t pngsize;
-    error = lodepng_encode24(&png, &pngsize, image_buffer, image_w, image_h);
+    error = lodepng_encode32(&png, &pngsize, image_buffer, image_w, image_h);
     if (!error)
     {
         lodepng_save_file(png, pngsize, new_filename);
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+#include "scratch_arena.h"
+
+static size_t align_size(size_t size)
+{
+    return (size + SCRATCH_ARENA_ALIGNMENT - 1) & ~(size_t)(SCRATCH_ARENA_ALIGNMENT - 1);
+}
+
+/* Replaces the block with one of arena->reserve bytes. Only called when nothing lives in the block.*/
+static void grow_block(scratch_arena *arena)
+{
+    void *block;
+    free(arena->block);
+    arena->block = NULL;
+    arena->capacity = 0;
+    if (posix_memalign(&block, SCRATCH_ARENA_ALIGNMENT, arena->reserve) == 0)
+    {
+        arena->block = block;
+        arena->capacity = arena->reserve;
+    }
+}
+
+void *scratch_arena_alloc(scratch_arena *arena, size_t size)
+{
+    size = align_size(size > 0 ? size : 1);
+    size_t offset = arena->used;
+    if (offset == 0 && arena->reserve > arena->capacity)
+    {
+        grow_block(arena);
+    }
+
+    arena->used += size;
+    arena->peak = arena->used > arena->peak ? arena->used : arena->peak;
+    if (arena->used <= arena->capacity)
+    {
+        return arena->block + offset;
+    }
+
+    // The header keeps the chain and the alignment of the payload.
+    void *spill;
+    if (posix_memalign(&spill, SCRATCH_ARENA_ALIGNMENT, SCRATCH_ARENA_ALIGNMENT + size) != 0)
+    {
+        return NULL;
+    }
+
+    *(void **)spill = arena->spills;
+    arena->spills = spill;
+    return (unsigned char *)spill + SCRATCH_ARENA_ALIGNMENT;
+}
+
+void *scratch_arena_calloc(scratch_arena *arena, size_t size)
+{
+    void *memory = scratch_arena_alloc(arena, size);
+    if (memory != NULL)
+    {
+        memset(memory, 0, size);
+    }
+
+    return memory;
+}
+
+void scratch_arena_rewind(scratch_arena *arena, size_t mark)
+{
+    // Spilled allocations stay until the reset, which sizes the block for them.
+    arena->used = mark < arena->used ? mark : arena->used;
+}
+
+static void free_spills(scratch_arena *arena)
+{
+    while (arena->spills != NULL)
+    {
+        void *next = *(void **)arena->spills;
+        free(arena->spills);
+        arena->spills = next;
+    }
+}
+
+void scratch_arena_reset(scratch_arena *arena)
+{
+    free_spills(arena);
+    arena->reserve = arena->peak > arena->reserve ? arena->peak : arena->reserve;
+    arena->used = 0;
+    arena->peak = 0;
+}
+
+void scratch_arena_release(scratch_arena *arena)
+{
+    free_spills(arena);
+    free(arena->block);
+    memset(arena, 0, sizeof(*arena));
+}
@@ -0,0 +1,34 @@
+#include <stddef.h>
+
+/* Scratch memory reused across calls. Allocations are 64-byte aligned bumps into one block. Ones that do not fit
+   are allocated separately until the next reset, after which the block grows to the largest size asked for, so
+   a series of calls needing the same or less memory stops allocating after the second. The block only grows on
+   the first allocation after a reset, so an arena used once never allocates it.*/
+typedef struct scratch_arena
+{
+    unsigned char *block;
+    size_t capacity;
+    size_t used; // Offset of the next allocation, counting the ones that did not fit.
+    size_t peak;
+    size_t reserve; // Size the block grows to on the next allocation at offset 0.
+    void *spills;   // Allocations outside the block, chained through their headers.
+} scratch_arena;
+
+#define SCRATCH_ARENA_ALIGNMENT 64
+
+/* Returns `size` bytes aligned to SCRATCH_ARENA_ALIGNMENT, valid until the arena is rewound past them or reset.
+   Not thread-safe; workers should be handed memory allocated before they start.*/
+void *scratch_arena_alloc(scratch_arena *arena, size_t size);
+
+/* Same as scratch_arena_alloc, but zeroed.*/
+void *scratch_arena_calloc(scratch_arena *arena, size_t size);
+
+/* Frees everything allocated after `mark`, a value of arena->used, for reuse by later allocations.*/
+void scratch_arena_rewind(scratch_arena *arena, size_t mark);
+
+/* Frees every allocation. When the allocations since the last reset did not fit the block, it grows before the
+   next one.*/
+void scratch_arena_reset(scratch_arena *arena);
+
+/* Frees the block. The arena is empty afterwards and may be used again.*/
+void scratch_arena_release(scratch_arena *arena);
@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+#define THREAD_POOL_MAX_WORKERS 255
+
+typedef struct thread_pool_worker
+{
+    pthread_t thread;
+    int index;
+    unsigned long seen_generation;
+} thread_pool_worker;
+
+typedef struct thread_pool
+{
+    pthread_mutex_t job_mutex; // Serializes callers, one job runs at a time.
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    thread_pool_worker workers[THREAD_POOL_MAX_WORKERS];
+    int worker_count;
+    unsigned long generation;
+    void (*task)(void *arg, int index);
+    void *arg;
+    int task_count;
+    int next_task;
+    int participants;
+    int busy;
+} thread_pool;
+
+static thread_pool pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER};
+
+int thread_pool_available_threads(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+static void run_tasks(void)
+{
+    int index;
+    while ((index = __atomic_fetch_add(&pool.next_task, 1, __ATOMIC_RELAXED)) < pool.task_count)
+    {
+        pool.task(pool.arg, index);
+    }
+}
+
+static void *worker_loop(void *data)
+{
+    thread_pool_worker *worker = data;
+    pthread_mutex_lock(&pool.mutex);
+    while (1)
+    {
+        while (worker->seen_generation == pool.generation)
+        {
+            pthread_cond_wait(&pool.work_ready, &pool.mutex);
+        }
+
+        worker->seen_generation = pool.generation;
+        if (worker->index >= pool.participants)
+        {
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool.mutex);
+        run_tasks();
+        pthread_mutex_lock(&pool.mutex);
+
+        if (--pool.busy == 0)
+        {
+            pthread_cond_signal(&pool.work_done);
+        }
+    }
+
+    return NULL;
+}
+
+void thread_pool_run(int threads, void (*task)(void *arg, int index), void *arg, int task_count)
+{
+    if (threads <= 0)
+    {
+        threads = thread_pool_available_threads();
+    }
+
+    int helpers = threads - 1;
+    if (helpers > task_count - 1)
+    {
+        helpers = task_count - 1;
+    }
+
+    if (helpers > THREAD_POOL_MAX_WORKERS)
+    {
+        helpers = THREAD_POOL_MAX_WORKERS;
+    }
+
+    if (helpers <= 0)
+    {
+        for (int i = 0; i < task_count; i++)
+        {
+            task(arg, i);
+        }
+
+        return;
+    }
+
+    pthread_mutex_lock(&pool.job_mutex);
+    pthread_mutex_lock(&pool.mutex);
+
+    while (pool.worker_count < helpers)
+    {
+        thread_pool_worker *worker = &pool.workers[pool.worker_count];
+        worker->index = pool.worker_count;
+        worker->seen_generation = pool.generation;
+        if (pthread_create(&worker->thread, NULL, &worker_loop, worker) != 0)
+        {
+            break;
+        }
+
+        pthread_detach(worker->thread);
+        pool.worker_count++;
+    }
+
+    pool.task = task;
+    pool.arg = arg;
+    pool.task_count = task_count;
+    pool.next_task = 0;
+    pool.participants = helpers < pool.worker_count ? helpers : pool.worker_count;
+    pool.busy = pool.participants;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.mutex);
+
+    run_tasks();
+
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.busy > 0)
+    {
+        pthread_cond_wait(&pool.work_done, &pool.mutex);
+    }
+
+    pthread_mutex_unlock(&pool.mutex);
+    pthread_mutex_unlock(&pool.job_mutex);
+}
@@ -0,0 +1,7 @@
+/* Number of online processors, used when a caller asks for threads <= 0.*/
+int thread_pool_available_threads(void);
+
+/* Runs task(arg, index) for every index in [0, task_count) on up to `threads` threads, the calling
+   thread included, and returns once all of them are done. Workers are started on first use and
+   live for the rest of the process.*/
+void thread_pool_run(int threads, void (*task)(void *arg, int index), void *arg, int task_count);